@@ -14,6 +14,12 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->loopHits = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -21,22 +27,24 @@ void initChunk(Chunk* chunk) {
  * Deallocate all of the memory and then call initChunk to zero out the fields
  * leaving the chunk in a well defined empty state.
  */
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, MEM_CHUNK, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, MEM_CHUNK, int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(vm, MEM_CHUNK, uint32_t, chunk->loopHits, chunk->loopCapacity);
+    FREE_ARRAY(vm, MEM_CHUNK, InlineCache, chunk->caches, chunk->cacheCapacity);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
 // Append a byte to the end of the chunk
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code =
-            GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines =
-            GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, MEM_CHUNK, uint8_t, chunk->code,
+                                 oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, MEM_CHUNK, int, chunk->lines,
+                                  oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
     chunk->lines[chunk->count] = line;
@@ -44,7 +52,35 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 // Add a constant to the value array for the chunk
-int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+    writeValueArray(vm, &chunk->constants, value);
     return chunk->constants.count - 1;  // return its index for later lookup
+}
+
+// Add a zeroed loop counter to the chunk and return its index
+int addLoop(VM* vm, Chunk* chunk) {
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loopHits = GROW_ARRAY(vm, MEM_CHUNK, uint32_t, chunk->loopHits,
+                                     oldCapacity, chunk->loopCapacity);
+    }
+    chunk->loopHits[chunk->loopCount] = 0;
+    return chunk->loopCount++;
+}
+
+// Add an empty inline cache to the chunk and return its index
+int addCache(VM* vm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, MEM_CHUNK, InlineCache, chunk->caches,
+                                   oldCapacity, chunk->cacheCapacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->offset = chunk->count;
+    cache->count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    return chunk->cacheCount++;
 }
\ No newline at end of file
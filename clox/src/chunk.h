@@ -30,14 +30,89 @@ typedef enum {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_CALL,
+    OP_CLOSURE,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_CLOSE_UPVALUE,
+    OP_CLASS,
+    OP_INHERIT,
+    OP_METHOD,
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_GET_SUPER,
+    OP_INVOKE,        // Calls a method without creating a bound method first
+    OP_SUPER_INVOKE,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
     OP_NOT,
     OP_RETURN,  // Return from the current function
+    // Type-specialized forms, only ever written over the generic instruction
+    // by the trace recorder once a hot loop has shown it operands that were
+    // all integers, or all doubles.
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    OP_DIVIDE_INT,
+    OP_GREATER_INT,
+    OP_LESS_INT,
+    OP_NEGATE_INT,
+    OP_ADD_DOUBLE,
+    OP_SUBTRACT_DOUBLE,
+    OP_MULTIPLY_DOUBLE,
+    OP_DIVIDE_DOUBLE,
+    OP_GREATER_DOUBLE,
+    OP_LESS_DOUBLE,
+    OP_NEGATE_DOUBLE,
 } OpCode;
 
+#define OPCODE_COUNT (OP_NEGATE_DOUBLE + 1)
+
+// OP_LOOP operand for loops past the 256 we keep execution counters for.
+#define LOOP_UNTRACKED UINT8_MAX
+
+/*
+ * OP_CLOSURE is followed by a (flags, index) pair of bytes for each variable
+ * the closure captures. These flags say where the variable comes from, and
+ * how to capture it.
+ */
+#define UPVALUE_LOCAL 0x1  // A local of the enclosing function, not one of its
+                           // upvalues
+#define UPVALUE_BOXED 0x2  // The local can be assigned, so share it through an
+                           // ObjUpvalue instead of copying its value
+
+/*
+ * Inline caches.
+ *
+ * Each property access, property assignment and method invocation site has a
+ * cache of what it found for the last few receiver shapes it saw, indexed by
+ * the 16-bit operand that follows the property name. A shape belongs to a
+ * single class, and neither shapes nor the methods of a class change once
+ * instances exist, so an entry stays valid for as long as the chunk lives.
+ */
+#define CACHE_ENTRIES 4          // Shapes cached before a site is megamorphic
+#define CACHE_UNTRACKED UINT16_MAX  // Operand for sites past the last cache
+
+struct ObjShape;
+
+typedef struct {
+    struct ObjShape* shape;  // Receiver shape the entry is for
+    struct ObjShape* next;   // For assignments that add a field, the shape the
+                             // receiver moves to, otherwise NULL
+    int slot;                // Slot of the field, or -1 for a method
+    Value method;
+} CacheEntry;
+
+typedef struct {
+    int offset;       // Where the site's cache operand is, for reports
+    int count;        // Entries in use
+    uint32_t hits;    // Receivers found in the cache
+    uint32_t misses;  // Receivers that went through the full lookup
+    CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
 /*
  * Defines a series of instructions.
  */
@@ -47,18 +122,30 @@ typedef struct {
     uint8_t* code;
     int* lines;  // Store the respective line numbers
     ValueArray constants;
+    int loopCount;
+    int loopCapacity;
+    uint32_t* loopHits;  // Times each loop's back edge has been taken
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 // Initialize a new chunk
 void initChunk(Chunk* chunk);
 
 // Free a chunk of memory
-void freeChunk(Chunk* chunk);
+void freeChunk(VM* vm, Chunk* chunk);
 
 // Append a byte to the end of the chunk
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
 
 // Add a constant to the chunk's valuearray
-int addConstant(Chunk* chunk, Value value);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+
+// Reserve an execution counter for a loop and return its index
+int addLoop(VM* vm, Chunk* chunk);
+
+// Reserve an empty inline cache for a property site and return its index
+int addCache(VM* vm, Chunk* chunk);
 
 #endif
\ No newline at end of file
@@ -9,9 +9,16 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_CODE
+// #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_CACHES
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// All state of an interpreter, see vm.h. Nearly everything takes one of these.
+typedef struct VM VM;
+
 #endif
\ No newline at end of file
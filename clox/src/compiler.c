@@ -10,18 +10,14 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;  // Prevents error cascades.
-} Parser;
+typedef struct Parser Parser;
 
 /*
  * Defines the precedence of several operations
@@ -51,13 +47,13 @@ typedef enum {
 } Precedence;
 
 /*
- * Defines the core lookup table for the Pratt parser.
+ * Defines the core lookup table for the Pratt parser->
  *
  * Tells the parser how to handle each token type in an expression, depending on
  * where that token appears and what its operator precedence is.
  */
 typedef void (*ParseFn)(
-    bool canAssign);  // Function pointer for parsing functions
+    Parser* parser, bool canAssign);  // Function pointer for parsing functions
 
 typedef struct {
     ParseFn prefix;  // Function to call if the token appears at the start
@@ -69,49 +65,119 @@ typedef struct {
  * Stores information on a local variable.
  */
 typedef struct {
-    Token name;  // Identifier
-    int depth;   // Degree of scope/nesting
+    Token name;       // Identifier
+    int depth;        // Degree of scope/nesting
+    bool isCaptured;  // Whether a closure refers to it
+    bool isBoxed;     // Whether it is ever assigned, in which case closures
+                      // must share it through an ObjUpvalue rather than copy it
 } Local;
 
 /*
- * Stores local variables that are in scope, ordered by declarations.
+ * Stores information on a variable captured by the function being compiled.
+ */
+typedef struct {
+    uint8_t index;  // Slot of the local, or index of the upvalue, it refers to
+                    // in the enclosing function
+    bool isLocal;
+} Upvalue;
+
+/*
+ * Where a closure copies one of our locals by value.
+ *
+ * We only find out that a local is assigned once we've parsed the assignment,
+ * which can come after a closure has already captured it. Each such capture
+ * is remembered so that its flags can be patched to box the local instead.
  */
 typedef struct {
+    int offset;    // Position of the capture's flags byte in the chunk
+    uint8_t slot;  // The local being captured
+} CaptureSite;
+
+/*
+ * Whether we are compiling a function body or the top level script.
+ */
+typedef enum {
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
+    TYPE_SCRIPT,
+} FunctionType;
+
+/*
+ * State for the function being compiled, including the local variables that
+ * are in scope, ordered by declarations.
+ *
+ * Compilers for nested function declarations form a stack through enclosing.
+ */
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    ObjFunction* function;  // The function whose chunk we are writing to
+    FunctionType type;
+
     Local locals[UINT8_COUNT];
     int localCount;
+    Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    CaptureSite* captureSites;
+    int captureSiteCount;
+    int captureSiteCapacity;
 } Compiler;
 
-Parser parser;          // Single global variable to avoid passing it around.
-Compiler* current;      // Global compiler pointer that stores local variables
-Chunk* compilingChunk;  // Global chunk pointer.
+/*
+ * State for the class being compiled. Classes can nest, so these form a stack
+ * through enclosing as well.
+ */
+typedef struct ClassCompiler {
+    struct ClassCompiler* enclosing;
+    bool hasSuperclass;
+} ClassCompiler;
+
+/*
+ * All the state of one compilation, which every function here is handed.
+ */
+struct Parser {
+    VM* vm;  // Where the objects the compiler creates go
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;  // Prevents error cascades.
+
+    Compiler* compiler;           // Innermost function being compiled
+    ClassCompiler* currentClass;  // Innermost class, NULL outside classes
+};
 
-static Chunk* currentChunk() { return compilingChunk; }
+static Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
+}
 
 /*
  * Forwards any error messages from the scanner to the user.
  */
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) return;  // Suppress subsequent errors
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return;  // Suppress subsequent errors
+    parser->panicMode = true;
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing
     } else {
-        fprintf(stderr, " at '%.*s", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->err, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void error(const char* message) { errorAt(&parser.previous, message); }
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
+}
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
 /*
@@ -120,201 +186,467 @@ static void errorAtCurrent(const char* message) {
  *
  * Also stores the previous token.
  */
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 /*
  * Reads the next token while validating its expected type.
  */
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
+}
 
 /*
  * If the current token has the given type, consume it and return true.
  * Else leave token alone, and return false.
  */
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
 /*
  * Helper functions to add bytes to the chunk.
  */
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
 /*
  * Compiles a loop (An easy way to jump from current position to a given
  * loopStart)
+ *
+ * The last operand names the loop's execution counter, which the vm uses to
+ * find hot loops.
  */
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
+
+    int offset = currentChunk(parser)->count - loopStart + 3;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
+
+    int loop = addLoop(parser->vm, currentChunk(parser));
+    emitByte(parser, loop < LOOP_UNTRACKED ? (uint8_t)loop : LOOP_UNTRACKED);
+}
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+/*
+ * Emits the operand of a property instruction that selects its inline cache.
+ */
+static void emitCache(Parser* parser) {
+    int cache = CACHE_UNTRACKED;
+    if (currentChunk(parser)->cacheCount < CACHE_UNTRACKED) {
+        cache = addCache(parser->vm, currentChunk(parser));
+    }
+    emitByte(parser, (cache >> 8) & 0xff);
+    emitByte(parser, cache & 0xff);
 }
 
 /*
  * Emit a jump instruction and a placeholder for the actual number of
  * instructions we want to jump
  */
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
     // -2 to offset for the bytecode for the jump offset.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
     // Replace the previous placeholder with the true instruction offset
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
 /*
  * Add constant to current chunk's value array and return the index.
  */
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+    // The value, often a string just created, is only reachable from the
+    // stack until it is in the constant table.
+    reserveStack(parser->vm, 1);
+    push(parser->vm, value);
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
+    writeBarrier(parser->vm, (Obj*)parser->compiler->function, value);
+    pop(parser->vm);
     if (constant > UINT8_MAX) {  // Make sure we don't have too many constants.
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+    compiler->enclosing = parser->compiler;
+    compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->captureSites = NULL;
+    compiler->captureSiteCount = 0;
+    compiler->captureSiteCapacity = 0;
+    // Linked in first, so that the collector finds the function from here on.
+    compiler->function = NULL;
+    parser->compiler = compiler;
+    compiler->function = newFunction(parser->vm);
+
+    if (type != TYPE_SCRIPT) {
+        parser->compiler->function->name = copyString(
+            parser->vm, parser->previous.start, parser->previous.length);
+        markBarrier(parser->vm, (Obj*)parser->compiler->function->name);
+    }
+
+    // Stack slot zero holds the function being called, claim it so that it
+    // can't be named by a local. In methods it holds the receiver instead,
+    // which the method refers to as 'this'.
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
+    local->depth = 0;
+    local->isCaptured = false;
+    local->isBoxed = false;
+    if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
 }
 
-static void emitReturn() { emitByte(OP_RETURN); }
+// Functions without an explicit return statement return nil, initializers
+// return the new instance.
+static void emitReturn(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
+    } else {
+        emitByte(parser, OP_NIL);
+    }
+    emitByte(parser, OP_RETURN);
+}
 
-static void endCompiler() {
-    emitReturn();
+/*
+ * Returns how an instruction changes the height of the stack, and stores its
+ * length, operands included.
+ */
+static int stackEffect(Chunk* chunk, int offset, int* length) {
+    uint8_t* code = &chunk->code[offset];
+    *length = 1;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLASS:
+            *length = 2;
+            return 1;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return 1;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+            *length = 2;
+            return 0;
+        case OP_DEFINE_GLOBAL:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            *length = 2;
+            return -1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            *length = 3;
+            return 0;
+        case OP_LOOP:
+            *length = 4;
+            return 0;
+        case OP_CALL:
+            *length = 2;
+            return -code[1];
+        case OP_CLOSURE: {
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[code[1]]);
+            *length = 2 + 2 * function->upvalueCount;
+            return 1;
+        }
+        case OP_GET_PROPERTY:
+            *length = 4;
+            return 0;
+        case OP_SET_PROPERTY:
+            *length = 4;
+            return -1;
+        case OP_INVOKE:
+            *length = 5;
+            return -code[2];
+        case OP_SUPER_INVOKE:
+            *length = 3;
+            return -code[2] - 1;
+        case OP_NEGATE:
+        case OP_NEGATE_INT:
+        case OP_NEGATE_DOUBLE:
+        case OP_NOT:
+        case OP_RETURN:
+            return 0;
+        default:
+            // Binary operators, and everything else that pops one value:
+            // OP_POP, OP_PRINT, OP_CLOSE_UPVALUE and OP_INHERIT.
+            return -1;
+    }
+}
 
-#ifdef DEBUG_PRINT_CODEg
+/*
+ * Works out the most stack slots a call to the function can ever use, so that
+ * the vm can make sure of the room once per call rather than on every push.
+ *
+ * Bytecode from structured code is simple to follow: jumps only go forward,
+ * apart from loops going back to code that has already been seen, and every
+ * path into an instruction arrives with the same stack height.
+ */
+static int maxStackSlots(Parser* parser, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    // Stack height at each jump target.
+    int* heights = ALLOCATE(parser->vm, MEM_COMPILER, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) heights[i] = -1;
+
+    int height = 1 + function->arity;  // The callee and its arguments
+    int max = height;
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count;) {
+        if (!reachable && heights[offset] != -1) {
+            height = heights[offset];  // Only ever jumped to
+        } else if (heights[offset] > height) {
+            height = heights[offset];
+        }
+        reachable = true;
+
+        int length;
+        height += stackEffect(chunk, offset, &length);
+        if (height > max) max = height;
+
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE) {
+            int target = offset + 3 +
+                         ((chunk->code[offset + 1] << 8) |
+                          chunk->code[offset + 2]);
+            if (heights[target] < height) heights[target] = height;
+        }
+        if (instruction == OP_JUMP || instruction == OP_LOOP ||
+            instruction == OP_RETURN) {
+            reachable = false;  // Nothing falls through
+        }
+        offset += length;
+    }
+
+    FREE_ARRAY(parser->vm, MEM_COMPILER, int, heights, chunk->count + 1);
+    return max;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    if (!parser->hadError) function->maxSlots = maxStackSlots(parser, function);
+
+#ifdef DEBUG_PRINT_CODE
     /*
      * If our code compiles successfully, we can print the chunk in debug mode.
      */
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if (!parser->hadError) {
+        disassembleChunk(currentChunk(parser),
+                         function->name != NULL ? function->name->chars
+                                                : "<script>");
     }
 #endif
+
+    FREE_ARRAY(parser->vm, MEM_COMPILER, CaptureSite,
+               parser->compiler->captureSites,
+               parser->compiler->captureSiteCapacity);
+    parser->compiler = parser->compiler->enclosing;
+    return function;
 }
-static void beginScope() { current->scopeDepth++; }
-static void endScope() {
-    current->scopeDepth--;
+
+/*
+ * Remembers that the closure being emitted copies a local, see CaptureSite.
+ */
+static void addCaptureSite(Parser* parser, uint8_t slot) {
+    Compiler* compiler = parser->compiler;
+    if (compiler->captureSiteCapacity < compiler->captureSiteCount + 1) {
+        int oldCapacity = compiler->captureSiteCapacity;
+        compiler->captureSiteCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->captureSites =
+            GROW_ARRAY(parser->vm, MEM_COMPILER, CaptureSite,
+                       compiler->captureSites, oldCapacity,
+                       compiler->captureSiteCapacity);
+    }
+    CaptureSite* site = &compiler->captureSites[compiler->captureSiteCount++];
+    site->offset = currentChunk(parser)->count;
+    site->slot = slot;
+}
+
+/*
+ * Forgets the capture sites of a local going out of scope, before its slot is
+ * reused by another local.
+ */
+static void removeCaptureSites(Parser* parser, uint8_t slot) {
+    Compiler* compiler = parser->compiler;
+    for (int i = compiler->captureSiteCount - 1; i >= 0; i--) {
+        if (compiler->captureSites[i].slot == slot) {
+            compiler->captureSites[i] =
+                compiler->captureSites[--compiler->captureSiteCount];
+        }
+    }
+}
+
+/*
+ * Makes closures share a local through an ObjUpvalue instead of copying it,
+ * including any that were already emitted.
+ */
+static void boxLocal(Compiler* compiler, int slot) {
+    Local* local = &compiler->locals[slot];
+    if (local->isBoxed) return;
+    local->isBoxed = true;
+    if (local->isCaptured) compiler->function->boxesLocals = true;
+
+    uint8_t* code = compiler->function->chunk.code;
+    for (int i = 0; i < compiler->captureSiteCount; i++) {
+        CaptureSite* site = &compiler->captureSites[i];
+        if (site->slot == slot) code[site->offset] |= UPVALUE_BOXED;
+    }
+}
+
+/*
+ * Boxes the local that an upvalue of compiler ultimately refers to, following
+ * the chain of upvalues out through the enclosing functions.
+ */
+static void boxUpvalue(Compiler* compiler, int index) {
+    Upvalue* upvalue = &compiler->upvalues[index];
+    while (!upvalue->isLocal) {
+        compiler = compiler->enclosing;
+        upvalue = &compiler->upvalues[upvalue->index];
+    }
+    boxLocal(compiler->enclosing, upvalue->index);
+}
+
+static void beginScope(Parser* parser) { parser->compiler->scopeDepth++; }
+static void endScope(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    compiler->scopeDepth--;
     // Remove local variables off the vm stack.
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth >
-               current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth >
+               compiler->scopeDepth) {
+        Local* local = &compiler->locals[compiler->localCount - 1];
+        if (local->isCaptured) {
+            removeCaptureSites(parser, compiler->localCount - 1);
+        }
+
+        // A boxed local has to be moved off the stack and into its box
+        if (local->isCaptured && local->isBoxed) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
+        } else {
+            emitByte(parser, OP_POP);
+        }
+        compiler->localCount--;
     }
 }
 
 // Forward declarations.
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
 /*
  * Compiles a binary expression.
  */
-static void binary(bool canAssign) {
+static void binary(Parser* parser, bool canAssign) {
     // Based on the operatorType, we determine which precedence we should
     // continue at
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitBytes(parser, OP_EQUAL, OP_NOT);
             break;
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL);
+            emitByte(parser, OP_EQUAL);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitByte(parser, OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitBytes(parser, OP_LESS, OP_NOT);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitByte(parser, OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitBytes(parser, OP_GREATER, OP_NOT);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            emitByte(parser, OP_ADD);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitByte(parser, OP_SUBTRACT);
             break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
+            emitByte(parser, OP_MULTIPLY);
             break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
+            emitByte(parser, OP_DIVIDE);
             break;
         default:
             return;
     }
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitByte(parser, OP_FALSE);
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitByte(parser, OP_NIL);
             break;
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitByte(parser, OP_TRUE);
             break;
         default:
             return;  // Unreachable.
@@ -324,20 +656,20 @@ static void literal(bool canAssign) {
 /*
  * Compiles an unary expression.
  */
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand.
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
     // we parse at the same level of precedence to allow things like !!x
 
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            emitByte(parser, OP_NOT);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitByte(parser, OP_NEGATE);
             break;
         default:
             return;  // Unreachable;
@@ -345,7 +677,7 @@ static void unary(bool canAssign) {
 }
 
 /*
- * The core recursive engine of the Pratt parser.
+ * The core recursive engine of the Pratt parser->
  *
  * Parses an expression whose operators have at least the given precedence
  * level.
@@ -355,13 +687,13 @@ static void unary(bool canAssign) {
  * repeatedly consumes infix operators as long as they are strong enough to take
  * the current expression as their left operand.
  */
-static void parsePrecedence(Precedence precedence) {
-    advance();
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
 
     // Handles prefix operators and literals
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
@@ -371,20 +703,20 @@ static void parsePrecedence(Precedence precedence) {
      * precedence (eg. nested assignment)
      */
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
     /*
      * If the assignment token hasn't been consumed, its been ignored because
      * somewhere the syntax is wrong. we return an error here.
      */
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -394,8 +726,9 @@ static void parsePrecedence(Precedence precedence) {
  * Identifier string is to large to be stored in the vm, so we add it to the
  * vm's constant table and access it using its index.
  */
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+    return makeConstant(
+        parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -406,13 +739,14 @@ static bool identifiersEqual(Token* a, Token* b) {
 /*
  * Gets the position of a local variable on the stack.
  */
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
             // prevent 'var a = a;'
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser,
+                      "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -420,67 +754,142 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;  // not local, must be global
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+/*
+ * Adds a captured variable to a function, reusing the existing upvalue if the
+ * function already captures it.
+ */
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index,
+                      bool isLocal) {
+    int upvalueCount = compiler->function->upvalueCount;
+
+    for (int i = 0; i < upvalueCount; i++) {
+        Upvalue* upvalue = &compiler->upvalues[i];
+        if (upvalue->index == index && upvalue->isLocal == isLocal) {
+            return i;
+        }
+    }
+
+    if (upvalueCount == UINT8_COUNT) {
+        error(parser, "Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[upvalueCount].isLocal = isLocal;
+    compiler->upvalues[upvalueCount].index = index;
+    return compiler->function->upvalueCount++;
+}
+
+/*
+ * Looks for a local variable declared in any of the surrounding functions.
+ *
+ * If it is found, every function between there and here captures it as an
+ * upvalue, and the index of the upvalue in this function is returned.
+ */
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
+    if (compiler->enclosing == NULL) return -1;  // Global
+
+    int local = resolveLocal(parser, compiler->enclosing, name);
+    if (local != -1) {
+        Compiler* enclosing = compiler->enclosing;
+        enclosing->locals[local].isCaptured = true;
+        if (enclosing->locals[local].isBoxed) {
+            enclosing->function->boxesLocals = true;
+        }
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
+    }
+
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
+    if (upvalue != -1) {
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+    }
+
+    return -1;
+}
+
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;  // indicate uninitialized state
+    local->isCaptured = false;
+    local->isBoxed = false;
 }
 
 /*
  * Compiler records the existence of a local variable
  */
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
     // Ignore if we are in global scope
-    if (current->scopeDepth == 0) return;
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
+    Token* name = &parser->previous;
 
     // Check for accidental redeclaration of a local variable in the same scope
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
+    declareVariable(parser);
 
     /*
      * If we are in local scope, there's no need to add the variable name to the
      * constant table of globals, so we can just return a dummy table index.
      */
-    if (current->scopeDepth > 0) return 0;
+    if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized() {
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+    // A function declared at the top level is bound to a global.
+    if (parser->compiler->scopeDepth == 0) return;
+    Compiler* compiler = parser->compiler;
+    compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(Parser* parser, uint8_t global) {
     // Don't define a global variable if we're in local scope.
-    if (current->scopeDepth > 0) {
-        markInitialized();
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
+}
+
+/*
+ * Compiles the arguments of a call, leaving them on the stack above the callee.
+ */
+static uint8_t argumentList(Parser* parser) {
+    uint8_t argCount = 0;
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(parser);
+            if (argCount == 255) {
+                error(parser, "Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
 }
 
 /*
@@ -490,32 +899,72 @@ static void defineVariable(uint8_t global) {
  * value is at the top of the stack. Then if the value is falsey, we can just
  * perform a jump to skip the right side of the expression.
  */
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
+}
+
+/*
+ * Compiles a call expression. The callee has already been compiled, and the
+ * '(' is an infix operator on it.
+ */
+static void call(Parser* parser, bool canAssign) {
+    (void)canAssign;
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+}
+
+/*
+ * Compiles a property access or assignment. The object has already been
+ * compiled, and the '.' is an infix operator on it.
+ */
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+        emitCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        // A method call, 'object.name(...)'
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+        emitCache(parser);
+    } else {
+        emitBytes(parser, OP_GET_PROPERTY, name);
+        emitCache(parser);
+    }
 }
 
 /*
  * Compiles a grouping expression.
  */
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
     // assume open bracket has been consumed
 }
 
 /*
  * Compiles a number literal.
  */
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
     // strtod: string to double, stops automatically when it reaches the first
     // non-numeric character
-    emitConstant(NUMBER_VAL(value));
+
+    // Whole numbers that fit take the vm's integer fast path.
+    if (value <= INT32_MAX && value == (double)(int32_t)value) {
+        emitConstant(parser, INT_VAL((int32_t)value));
+    } else {
+        emitConstant(parser, NUMBER_VAL(value));
+    }
 }
 
 /*
@@ -525,23 +974,24 @@ static void number(bool canAssign) {
  * which is actually a unconditional jump to the end of theend of the
  * expression.
  */
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 /*
  * Compiles a string literal.
  */
-static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+                                            parser->previous.start + 1,
+                                            parser->previous.length - 2)));
 }
 
 /*
@@ -550,27 +1000,79 @@ static void string(bool canAssign) {
  * 'Declaring' is when the variable is added to scope.
  * 'Defining' is then the variable is ready to use.
  */
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
+        getOp = OP_GET_UPVALUE;
+        setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);  // Variable assignment
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        // Closures can't copy a variable that may change under them.
+        if (setOp == OP_SET_LOCAL) boxLocal(parser->compiler, arg);
+        if (setOp == OP_SET_UPVALUE) boxUpvalue(parser->compiler, arg);
+
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);  // Variable assignment
     } else {
-        emitBytes(getOp, (uint8_t)arg);  // Variable access
+        emitBytes(parser, getOp, (uint8_t)arg);  // Variable access
     }
 }
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
+}
+
+static Token syntheticToken(const char* text) {
+    Token token;
+    token.start = text;
+    token.length = (int)strlen(text);
+    return token;
+}
+
+/*
+ * Compiles 'super.method', which looks the method up starting from the
+ * superclass of the class the current method is declared in.
+ */
+static void super_(Parser* parser, bool canAssign) {
+    (void)canAssign;
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
+    } else {
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
+    }
+}
+
+static void this_(Parser* parser, bool canAssign) {
+    (void)canAssign;
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
+        return;
+    }
+
+    variable(parser, false);  // 'this' can't be assigned to
 }
 
 /*
@@ -580,12 +1082,12 @@ static void variable(bool canAssign) {
  * type of token, as well as its precedence.
  */
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -613,8 +1115,8 @@ ParseRule rules[] = {
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -624,28 +1126,160 @@ ParseRule rules[] = {
 
 static ParseRule* getRule(TokenType type) { return &rules[type]; }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
+}
+
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}");
+}
+
+/*
+ * Compiles a function's parameters and body, then emits the finished function
+ * as a constant in the surrounding chunk.
+ */
+static void function(Parser* parser, FunctionType type) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, type);
+    // No matching endScope(), the frame is discarded on return.
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            }
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+
+    ObjFunction* function = endCompiler(parser);
+    if (function->upvalueCount == 0) {
+        // Nothing captured, the bare function will do.
+        emitBytes(parser, OP_CONSTANT, makeConstant(parser, OBJ_VAL(function)));
+        return;
+    }
+
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
+    for (int i = 0; i < function->upvalueCount; i++) {
+        Upvalue* upvalue = &compiler.upvalues[i];
+        if (!upvalue->isLocal) {
+            // Whatever the enclosing closure holds, value or box, is copied.
+            emitBytes(parser, 0, upvalue->index);
+            continue;
+        }
+
+        // A local function that refers to itself captures its own slot before
+        // the closure has been stored there, so it can't be copied.
+        if (type == TYPE_FUNCTION && parser->compiler->scopeDepth > 0 &&
+            upvalue->index == parser->compiler->localCount - 1) {
+            boxLocal(parser->compiler, upvalue->index);
+        }
+
+        if (parser->compiler->locals[upvalue->index].isBoxed) {
+            emitByte(parser, UPVALUE_LOCAL | UPVALUE_BOXED);
+        } else {
+            addCaptureSite(parser, upvalue->index);
+            emitByte(parser, UPVALUE_LOCAL);
+        }
+        emitByte(parser, upvalue->index);
+    }
+}
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+/*
+ * Compiles a method and adds it to the class, which is on top of the stack.
+ */
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
+
+    FunctionType type = TYPE_METHOD;
+    if (parser->previous.length == 4 &&
+        memcmp(parser->previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}");
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void varDeclaration() {
-    uint8_t global =
-        parseVariable("Expect variable name.");  // index of the constnat in the
-                                                 // vm's constant table.
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
+
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, nameConstant);
+
+    ClassCompiler classCompiler;
+    classCompiler.hasSuperclass = false;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
-    if (match(TOKEN_EQUAL)) {
-        expression();  // Initializes variable with expression.
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
+
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
+        }
+
+        // Methods find the superclass through a local named 'super', in a
+        // scope of its own so that sibling classes each get theirs.
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
+
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
+        classCompiler.hasSuperclass = true;
+    }
+
+    namedVariable(parser, className, false);  // Load the class for OP_METHOD
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
+
+    if (classCompiler.hasSuperclass) {
+        endScope(parser);
+    }
+
+    parser->currentClass = parser->currentClass->enclosing;
+}
+
+static void funDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(parser, "Expect function name.");
+    // Functions can refer to themselves, so the name is usable right away.
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
+}
+
+static void varDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(
+        parser, "Expect variable name.");  // index of the constnat in the
+                                           // vm's constant table.
+
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);  // Initializes variable with expression.
     } else {
-        emitByte(OP_NIL);  // var a;
+        emitByte(parser, OP_NIL);  // var a;
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    defineVariable(global);  // Access constant table by its index.
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(parser, global);  // Access constant table by its index.
 }
 
 /*
@@ -654,37 +1288,36 @@ static void varDeclaration() {
  * How you write a expression where a statement is expected, usually to evaluate
  * something for its side effects. eg.: eat(brunch);
  */
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-    beginScope();
+static void forStatement(Parser* parser) {
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
     // Initializer clause
-    if (match(TOKEN_SEMICOLON)) {
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';'.");
 
     // Condition clause
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of loop if condition (currently on the top of vm) is false
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);  // Condition
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);  // Condition
     }
 
     /*
@@ -695,38 +1328,39 @@ static void forStatement() {
      * pass, so we jump over the increment, run the body, jump back to the
      * increment, run it, and then go to the next iteration.
      */
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);  // We only need the side effect of the expression, so
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser,
+                 OP_POP);  // We only need the side effect of the expression, so
                            // pop the value
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     // Condition exists, this is not an infinite loop.
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);  // pop the Condition at top of vm
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);  // pop the Condition at top of vm
     }
 
-    endScope();
+    endScope(parser);
 }
 
 /*
  * Compiles a if statement.
  */
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     /*
      * We need to know how far to jump, ie. how many instructions to skip. But
@@ -736,22 +1370,40 @@ static void ifStatement() {
      * statement, and then go back to replace the placeholder offset with the
      * real number of instructions.
      */
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);  // Pop the condition value from vm
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);  // Pop the condition value from vm
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);  // Pop the condition value from vm
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);  // Pop the condition value from vm
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
+}
+
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
+    }
+
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
+    } else {
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
+        }
+
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitByte(parser, OP_RETURN);
+    }
 }
 
 /*
@@ -762,19 +1414,19 @@ static void printStatement() {
  * jumpst to loopStart, where we start compiling the loop again with
  * expression();
  */
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
-
-    patchJump(exitJump);
-    emitByte(OP_POP);
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
 /*
@@ -784,12 +1436,12 @@ static void whileStatement() {
  * Skip statements until we reach something that looks like a statement
  * boundary, ie. a semicolon. then continue compiling.
  */
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -801,24 +1453,29 @@ static void synchronize() {
                 return;
             default:;  // Do nothing
         }
-        advance();
+        advance(parser);
     }
 }
 
 /*
  * Compiles a declaration statement.
  */
-static void declaration() {
-    if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panicMode)
-        synchronize();  // error recovery to minimize the number of cascading
-                        // compile errors, use each statement as the boundary to
-                        // synchronize errors.
+    if (parser->panicMode)
+        synchronize(
+            parser);  // error recovery to minimize the number of cascading
+                      // compile errors, use each statement as the boundary to
+                      // synchronize errors.
 }
 
 /*
@@ -826,39 +1483,62 @@ static void declaration() {
  *
  * Consists of print statements, expression statements, block statements
  */
-static void statement() {
-    if (match(TOKEN_PRINT)) {  // print statement
-        printStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {  // block statement
-        beginScope();
-        block();
-        endScope();
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {  // print statement
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {  // block statement
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();  // expression statements
+        expressionStatement(parser);  // expression statements
     }
 }
 
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler);
-    compilingChunk = chunk;
-
+/*
+ * Compiles a script into the implicit function that wraps the top level code.
+ *
+ * Returns NULL if there was a compile error.
+ */
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser;
+    parser.vm = vm;
+    initScanner(&parser.scanner, source);
     parser.hadError = false;
-    parser.panicMode = true;
+    parser.panicMode = false;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
+    vm->parser = &parser;
 
-    advance();
+    Compiler compiler;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    advance(&parser);
+
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    endCompiler();  // Finish compiling code; send OP_RETURN
-    return !parser.hadError;
+    ObjFunction* function = endCompiler(&parser);  // Finish compiling code
+    vm->parser = NULL;
+    return parser.hadError ? NULL : function;
+}
+
+/*
+ * The functions still being compiled are reachable from nothing else.
+ */
+void markCompilerRoots(VM* vm, Marker* marker) {
+    if (vm->parser == NULL) return;
+    for (Compiler* compiler = vm->parser->compiler; compiler != NULL;
+         compiler = compiler->enclosing) {
+        markObject(marker, (Obj*)compiler->function);
+    }
 }
\ No newline at end of file
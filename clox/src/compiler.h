@@ -1,9 +1,11 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 
+#include "memory.h"
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+ObjFunction* compile(VM* vm, const char* source);
+void markCompilerRoots(VM* vm, Marker* marker);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "copy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "task.h"
+#include "vm.h"
+
+#define COPY_MAP_MAX_LOAD 0.75
+
+void initCopyMap(CopyMap* copies) {
+    copies->count = 0;
+    copies->capacity = 0;
+    copies->entries = NULL;
+    copies->globals = NULL;
+    copies->nameCount = 0;
+    copies->nameCapacity = 0;
+    copies->names = NULL;
+}
+
+void freeCopyMap(VM* vm, CopyMap* copies) {
+    FREE_ARRAY(vm, MEM_COPIES, CopyEntry, copies->entries, copies->capacity);
+    FREE_ARRAY(vm, MEM_COPIES, ObjString*, copies->names,
+               copies->nameCapacity);
+    initCopyMap(copies);
+}
+
+/*
+ * The map is keyed by address with linear probing. Entries are never removed,
+ * so there are no tombstones.
+ */
+static CopyEntry* findCopy(CopyEntry* entries, int capacity, Obj* from) {
+    uint32_t index = (uint32_t)(((uintptr_t)from >> 3) * 2654435761u) %
+                     (uint32_t)capacity;
+    for (;;) {
+        CopyEntry* entry = &entries[index];
+        if (entry->from == from || entry->from == NULL) return entry;
+        index = (index + 1) % capacity;
+    }
+}
+
+static Obj* lookupCopy(CopyMap* copies, Obj* from) {
+    if (copies->count == 0) return NULL;
+    return findCopy(copies->entries, copies->capacity, from)->to;
+}
+
+/*
+ * Remembers the copy of an object before its contents are copied, so that
+ * references back to it from its contents end at the copy.
+ */
+static void addCopy(VM* vm, CopyMap* copies, Obj* from, Obj* to) {
+    if (copies->count + 1 > copies->capacity * COPY_MAP_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(copies->capacity);
+        CopyEntry* entries = ALLOCATE(vm, MEM_COPIES, CopyEntry, capacity);
+        for (int i = 0; i < capacity; i++) {
+            entries[i].from = NULL;
+            entries[i].to = NULL;
+        }
+        for (int i = 0; i < copies->capacity; i++) {
+            CopyEntry* entry = &copies->entries[i];
+            if (entry->from == NULL) continue;
+            *findCopy(entries, capacity, entry->from) = *entry;
+        }
+        FREE_ARRAY(vm, MEM_COPIES, CopyEntry, copies->entries,
+                   copies->capacity);
+        copies->entries = entries;
+        copies->capacity = capacity;
+    }
+
+    CopyEntry* entry = findCopy(copies->entries, copies->capacity, from);
+    entry->from = from;
+    entry->to = to;
+    copies->count++;
+}
+
+static ObjString* copyStringObject(VM* vm, ObjString* string) {
+    if (string == NULL) return NULL;
+    return copyString(vm, string->chars, string->length);
+}
+
+/*
+ * Notes a string constant of copied code that names a global, for
+ * copyGlobals(). Copying it right away could copy a closure that names itself
+ * a second time, before the first copy is in the map.
+ */
+static void addGlobalName(VM* vm, CopyMap* copies, Value constant) {
+    if (copies->globals == NULL || !IS_STRING(constant)) return;
+    Value value;
+    if (!tableGet(copies->globals, AS_STRING(constant), &value)) return;
+
+    if (copies->nameCount == copies->nameCapacity) {
+        int capacity = GROW_CAPACITY(copies->nameCapacity);
+        copies->names = GROW_ARRAY(vm, MEM_COPIES, ObjString*, copies->names,
+                                   copies->nameCapacity, capacity);
+        copies->nameCapacity = capacity;
+    }
+    copies->names[copies->nameCount++] = AS_STRING(constant);
+}
+
+static void copyTable(VM* vm, CopyMap* copies, Table* from, Table* to) {
+    for (int i = 0; i < from->capacity; i++) {
+        Entry* entry = &from->entries[i];
+        if (entry->key == NULL) continue;
+        tableSet(vm, to, copyStringObject(vm, entry->key),
+                 copyValue(vm, copies, entry->value));
+    }
+}
+
+/*
+ * Copies the code of a function as it is now, specialized instructions and
+ * all, since those guard on their operands anyway. What the function learned
+ * about the other heap, its inline caches, starts out empty.
+ */
+static ObjFunction* copyFunction(VM* vm, CopyMap* copies, ObjFunction* from) {
+    ObjFunction* function = newFunction(vm);
+    addCopy(vm, copies, (Obj*)from, (Obj*)function);
+    function->arity = from->arity;
+    function->upvalueCount = from->upvalueCount;
+    function->maxSlots = from->maxSlots;
+    function->boxesLocals = from->boxesLocals;
+    function->name = copyStringObject(vm, from->name);
+
+    Chunk* chunk = &function->chunk;
+    for (int i = 0; i < from->chunk.count; i++) {
+        writeChunk(vm, chunk, from->chunk.code[i], from->chunk.lines[i]);
+    }
+    for (int i = 0; i < from->chunk.constants.count; i++) {
+        Value constant = from->chunk.constants.values[i];
+        addConstant(vm, chunk, copyValue(vm, copies, constant));
+        addGlobalName(vm, copies, constant);
+    }
+    for (int i = 0; i < from->chunk.loopCount; i++) addLoop(vm, chunk);
+    for (int i = 0; i < from->chunk.cacheCount; i++) {
+        int cache = addCache(vm, chunk);
+        chunk->caches[cache].offset = from->chunk.caches[i].offset;
+    }
+    return function;
+}
+
+static ObjClass* copyClass(VM* vm, CopyMap* copies, ObjClass* from) {
+    ObjClass* klass = newClass(vm, copyStringObject(vm, from->name));
+    addCopy(vm, copies, (Obj*)from, (Obj*)klass);
+    klass->inlineFields = from->inlineFields;
+    copyTable(vm, copies, &from->methods, &klass->methods);
+    return klass;
+}
+
+/*
+ * Fields are added in slot order, so that the copy ends up with the same
+ * layout, in shapes of the copied class.
+ */
+static ObjInstance* copyInstance(VM* vm, CopyMap* copies, ObjInstance* from) {
+    ObjClass* klass = AS_CLASS(copyValue(vm, copies, OBJ_VAL(from->klass)));
+    ObjInstance* instance = newInstance(vm, klass);
+    addCopy(vm, copies, (Obj*)from, (Obj*)instance);
+
+    int fieldCount = from->shape->fieldCount;
+    ObjString** names = ALLOCATE(vm, MEM_COPIES, ObjString*, fieldCount);
+    for (ObjShape* shape = from->shape; shape->parent != NULL;
+         shape = shape->parent) {
+        names[shape->fieldCount - 1] = shape->name;
+    }
+    for (int slot = 0; slot < fieldCount; slot++) {
+        addField(vm, instance, copyStringObject(vm, names[slot]),
+                 copyValue(vm, copies, *instanceField(from, slot)));
+    }
+    FREE_ARRAY(vm, MEM_COPIES, ObjString*, names, fieldCount);
+    return instance;
+}
+
+static ObjClosure* copyClosure(VM* vm, CopyMap* copies, ObjClosure* from) {
+    ObjFunction* function =
+        AS_FUNCTION(copyValue(vm, copies, OBJ_VAL(from->function)));
+    ObjClosure* closure = newClosure(vm, function);
+    addCopy(vm, copies, (Obj*)from, (Obj*)closure);
+    for (int i = 0; i < from->upvalueCount; i++) {
+        closure->upvalues[i] = copyValue(vm, copies, from->upvalues[i]);
+    }
+    return closure;
+}
+
+/*
+ * A box that is still open points into the other VM's stack, so the copy is
+ * closed over the variable's current value.
+ */
+static ObjUpvalue* copyUpvalue(VM* vm, CopyMap* copies, ObjUpvalue* from) {
+    ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+    addCopy(vm, copies, (Obj*)from, (Obj*)upvalue);
+    upvalue->closed = copyValue(vm, copies, *from->location);
+    upvalue->location = &upvalue->closed;
+    return upvalue;
+}
+
+Value copyValue(VM* vm, CopyMap* copies, Value value) {
+    if (!IS_OBJ(value)) return value;
+
+    Obj* copy = lookupCopy(copies, AS_OBJ(value));
+    if (copy != NULL) return OBJ_VAL(copy);
+
+    switch (OBJ_TYPE(value)) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* from = AS_BOUND_METHOD(value);
+            ObjBoundMethod* bound = newBoundMethod(vm, NIL_VAL, NIL_VAL);
+            addCopy(vm, copies, (Obj*)from, (Obj*)bound);
+            bound->receiver = copyValue(vm, copies, from->receiver);
+            bound->method = copyValue(vm, copies, from->method);
+            return OBJ_VAL(bound);
+        }
+        case OBJ_CLASS:
+            return OBJ_VAL(copyClass(vm, copies, AS_CLASS(value)));
+        case OBJ_CLOSURE:
+            return OBJ_VAL(copyClosure(vm, copies, AS_CLOSURE(value)));
+        case OBJ_FUNCTION:
+            return OBJ_VAL(copyFunction(vm, copies, AS_FUNCTION(value)));
+        case OBJ_INSTANCE:
+            return OBJ_VAL(copyInstance(vm, copies, AS_INSTANCE(value)));
+        case OBJ_NATIVE: {
+            ObjNative* from = AS_NATIVE(value);
+            return OBJ_VAL(newNative(vm, from->function, from->arity,
+                                     copyStringObject(vm, from->name)));
+        }
+        case OBJ_STRING:
+            // Interned, so equal strings stay equal after the copy.
+            return OBJ_VAL(copyStringObject(vm, AS_STRING(value)));
+        case OBJ_TASK:
+            // The task itself is shared, only the handle is new.
+            return OBJ_VAL(newTask(vm, retainTask(AS_TASK(value)->task)));
+        case OBJ_UPVALUE:
+            return OBJ_VAL(copyUpvalue(vm, copies, AS_UPVALUE(value)));
+        case OBJ_SHAPE:
+            break;  // Never a value
+    }
+    return NIL_VAL;
+}
+
+/*
+ * A global that has been copied is remembered in the map by its name. Strings
+ * are never in the map otherwise, and the copy of a name is its interned copy
+ * anyway.
+ */
+void copyGlobals(VM* vm, CopyMap* copies) {
+    // Copying a value may find more names.
+    for (int i = 0; i < copies->nameCount; i++) {
+        ObjString* name = copies->names[i];
+        if (lookupCopy(copies, (Obj*)name) != NULL) continue;
+
+        ObjString* copy = copyStringObject(vm, name);
+        addCopy(vm, copies, (Obj*)name, (Obj*)copy);
+        Value value;
+        tableGet(copies->globals, name, &value);
+        tableSet(vm, &vm->globals, copy, copyValue(vm, copies, value));
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef clox_copy_h
+#define clox_copy_h
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+/*
+ * Deep copies of values from one VM's heap into another's, which is how values
+ * travel between tasks: VMs never point into each other's heaps.
+ *
+ * The copies made so far are remembered by the object they were copied from,
+ * so that an object reachable along several paths, or along a cycle, is copied
+ * once and the copy keeps the original's shape.
+ *
+ * When the map is given the globals of the source VM, the globals that copied
+ * code may name are copied along, into the globals of vm, by copyGlobals().
+ * Code names a global with a string constant, so every string constant that is
+ * the name of a global counts, which copies a few too many at worst.
+ */
+typedef struct {
+    Obj* from;
+    Obj* to;
+} CopyEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    CopyEntry* entries;
+
+    Table* globals;  // Of the source VM, or NULL to leave globals alone
+    // Names of globals found in copied code, in the source heap, to copy yet.
+    int nameCount;
+    int nameCapacity;
+    ObjString** names;
+} CopyMap;
+
+void initCopyMap(CopyMap* copies);
+void freeCopyMap(VM* vm, CopyMap* copies);
+
+// Copy value into the heap of vm. The source heap is only read.
+Value copyValue(VM* vm, CopyMap* copies, Value value);
+
+// Copy the globals that the code copied so far names, and that their values
+// name in turn.
+void copyGlobals(VM* vm, CopyMap* copies);
+
+#endif
\ No newline at end of file
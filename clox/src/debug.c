@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 
+#include "object.h"
 #include "value.h"
 
 // Display the instruction in a human readable format
@@ -23,16 +24,84 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign + jump);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+/*
+ * A backward jump, followed by the index of the loop's execution counter.
+ */
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint8_t loop = chunk->code[offset + 3];
+    printf("%-16s %4d -> %d (loop %d)\n", name, offset, offset + 4 - jump,
+           loop);
+    return offset + 4;
+}
+
+/*
+ * Show the function a closure is made from, and where each of its captured
+ * variables comes from.
+ */
+static int closureInstruction(const char* name, Chunk* chunk, int offset) {
+    offset++;
+    uint8_t constant = chunk->code[offset++];
+    printf("%-16s %4d ", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        uint8_t flags = chunk->code[offset++];
+        uint8_t index = chunk->code[offset++];
+        printf("%04d      |                     %s %d%s\n", offset - 2,
+               (flags & UPVALUE_LOCAL) ? "local" : "upvalue", index,
+               (flags & UPVALUE_BOXED) ? " (boxed)" : "");
+    }
+    return offset;
+}
+
+/*
+ * A property name followed by the index of the site's inline cache.
+ */
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 4;
+}
+
+/*
+ * A method name and argument count, followed by the index of the site's inline
+ * cache unless it is a super call, which always knows where to look.
+ */
+static int invokeInstruction(const char* name, Chunk* chunk, int offset,
+                             bool cached) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    if (!cached) {
+        printf("'\n");
+        return offset + 3;
+    }
+
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
+}
+
 // Display a constant in a human readable format
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant =
         chunk->code[offset + 1];  // get the constant after the bytecode
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(stdout, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 2;  // After the constant
 }
@@ -76,11 +145,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return simpleInstruction("OP_GET_GLOBAL", offset);
+            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return simpleInstruction("OP_DEFINE_GLOBAL", offset);
+            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return simpleInstruction("OP_SET_GLOBAL", offset);
+            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -106,11 +175,145 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return loopInstruction("OP_LOOP", chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset);
+        case OP_GET_UPVALUE:
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE:
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_CLOSE_UPVALUE:
+            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+        case OP_CLASS:
+            return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_INHERIT:
+            return simpleInstruction("OP_INHERIT", offset);
+        case OP_METHOD:
+            return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_GET_PROPERTY:
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_SUPER:
+            return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_INVOKE:
+            return invokeInstruction("OP_INVOKE", chunk, offset, true);
+        case OP_SUPER_INVOKE:
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, false);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_ADD_INT:
+            return simpleInstruction("OP_ADD_INT", offset);
+        case OP_SUBTRACT_INT:
+            return simpleInstruction("OP_SUBTRACT_INT", offset);
+        case OP_MULTIPLY_INT:
+            return simpleInstruction("OP_MULTIPLY_INT", offset);
+        case OP_DIVIDE_INT:
+            return simpleInstruction("OP_DIVIDE_INT", offset);
+        case OP_GREATER_INT:
+            return simpleInstruction("OP_GREATER_INT", offset);
+        case OP_LESS_INT:
+            return simpleInstruction("OP_LESS_INT", offset);
+        case OP_NEGATE_INT:
+            return simpleInstruction("OP_NEGATE_INT", offset);
+        case OP_ADD_DOUBLE:
+            return simpleInstruction("OP_ADD_DOUBLE", offset);
+        case OP_SUBTRACT_DOUBLE:
+            return simpleInstruction("OP_SUBTRACT_DOUBLE", offset);
+        case OP_MULTIPLY_DOUBLE:
+            return simpleInstruction("OP_MULTIPLY_DOUBLE", offset);
+        case OP_DIVIDE_DOUBLE:
+            return simpleInstruction("OP_DIVIDE_DOUBLE", offset);
+        case OP_GREATER_DOUBLE:
+            return simpleInstruction("OP_GREATER_DOUBLE", offset);
+        case OP_LESS_DOUBLE:
+            return simpleInstruction("OP_LESS_DOUBLE", offset);
+        case OP_NEGATE_DOUBLE:
+            return simpleInstruction("OP_NEGATE_DOUBLE", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+/*
+ * Reports how well the inline caches of a chunk did. A site whose cache is full
+ * may have seen more shapes than it has entries for, and keeps missing on
+ * those.
+ */
+void printCacheStats(Chunk* chunk, const char* name) {
+    if (chunk->cacheCount == 0) return;
+
+    printf("== %s caches ==\n", name);
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        uint64_t total = (uint64_t)cache->hits + cache->misses;
+        if (total == 0) continue;  // Never ran
+
+        printf("%4d [line %d] %d shape%s, %u hits, %u misses (%.1f%%)\n", i,
+               chunk->lines[cache->offset], cache->count,
+               cache->count == 1 ? "" : "s", cache->hits, cache->misses,
+               100.0 * cache->hits / total);
+    }
+}
+
+static const char* opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_ADD_INT] = "OP_ADD_INT",
+    [OP_SUBTRACT_INT] = "OP_SUBTRACT_INT",
+    [OP_MULTIPLY_INT] = "OP_MULTIPLY_INT",
+    [OP_DIVIDE_INT] = "OP_DIVIDE_INT",
+    [OP_GREATER_INT] = "OP_GREATER_INT",
+    [OP_LESS_INT] = "OP_LESS_INT",
+    [OP_NEGATE_INT] = "OP_NEGATE_INT",
+    [OP_ADD_DOUBLE] = "OP_ADD_DOUBLE",
+    [OP_SUBTRACT_DOUBLE] = "OP_SUBTRACT_DOUBLE",
+    [OP_MULTIPLY_DOUBLE] = "OP_MULTIPLY_DOUBLE",
+    [OP_DIVIDE_DOUBLE] = "OP_DIVIDE_DOUBLE",
+    [OP_GREATER_DOUBLE] = "OP_GREATER_DOUBLE",
+    [OP_LESS_DOUBLE] = "OP_LESS_DOUBLE",
+    [OP_NEGATE_DOUBLE] = "OP_NEGATE_DOUBLE",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= OPCODE_COUNT) return "OP_UNKNOWN";
+    return opcodeNames[instruction];
+}
\ No newline at end of file
@@ -5,5 +5,7 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+void printCacheStats(Chunk* chunk, const char* name);
+const char* opcodeName(uint8_t instruction);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,403 @@
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A 64-bit significand and a binary exponent, f * 2^e.
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+typedef struct {
+    uint64_t f;
+    int16_t e;
+    int16_t k;  // The power of ten, 10^k
+} CachedPower;
+
+// Every 8th power of ten from 10^-348 to 10^340, rounded to 64 bits. Generated
+// with exact fractions.
+static const CachedPower cachedPowers[] = {
+    {0xfa8fd5a0081c0288, -1220, -348},
+    {0xbaaee17fa23ebf76, -1193, -340},
+    {0x8b16fb203055ac76, -1166, -332},
+    {0xcf42894a5dce35ea, -1140, -324},
+    {0x9a6bb0aa55653b2d, -1113, -316},
+    {0xe61acf033d1a45df, -1087, -308},
+    {0xab70fe17c79ac6ca, -1060, -300},
+    {0xff77b1fcbebcdc4f, -1034, -292},
+    {0xbe5691ef416bd60c, -1007, -284},
+    {0x8dd01fad907ffc3c, -980, -276},
+    {0xd3515c2831559a83, -954, -268},
+    {0x9d71ac8fada6c9b5, -927, -260},
+    {0xea9c227723ee8bcb, -901, -252},
+    {0xaecc49914078536d, -874, -244},
+    {0x823c12795db6ce57, -847, -236},
+    {0xc21094364dfb5637, -821, -228},
+    {0x9096ea6f3848984f, -794, -220},
+    {0xd77485cb25823ac7, -768, -212},
+    {0xa086cfcd97bf97f4, -741, -204},
+    {0xef340a98172aace5, -715, -196},
+    {0xb23867fb2a35b28e, -688, -188},
+    {0x84c8d4dfd2c63f3b, -661, -180},
+    {0xc5dd44271ad3cdba, -635, -172},
+    {0x936b9fcebb25c996, -608, -164},
+    {0xdbac6c247d62a584, -582, -156},
+    {0xa3ab66580d5fdaf6, -555, -148},
+    {0xf3e2f893dec3f126, -529, -140},
+    {0xb5b5ada8aaff80b8, -502, -132},
+    {0x87625f056c7c4a8b, -475, -124},
+    {0xc9bcff6034c13053, -449, -116},
+    {0x964e858c91ba2655, -422, -108},
+    {0xdff9772470297ebd, -396, -100},
+    {0xa6dfbd9fb8e5b88f, -369, -92},
+    {0xf8a95fcf88747d94, -343, -84},
+    {0xb94470938fa89bcf, -316, -76},
+    {0x8a08f0f8bf0f156b, -289, -68},
+    {0xcdb02555653131b6, -263, -60},
+    {0x993fe2c6d07b7fac, -236, -52},
+    {0xe45c10c42a2b3b06, -210, -44},
+    {0xaa242499697392d3, -183, -36},
+    {0xfd87b5f28300ca0e, -157, -28},
+    {0xbce5086492111aeb, -130, -20},
+    {0x8cbccc096f5088cc, -103, -12},
+    {0xd1b71758e219652c, -77, -4},
+    {0x9c40000000000000, -50, 4},
+    {0xe8d4a51000000000, -24, 12},
+    {0xad78ebc5ac620000, 3, 20},
+    {0x813f3978f8940984, 30, 28},
+    {0xc097ce7bc90715b3, 56, 36},
+    {0x8f7e32ce7bea5c70, 83, 44},
+    {0xd5d238a4abe98068, 109, 52},
+    {0x9f4f2726179a2245, 136, 60},
+    {0xed63a231d4c4fb27, 162, 68},
+    {0xb0de65388cc8ada8, 189, 76},
+    {0x83c7088e1aab65db, 216, 84},
+    {0xc45d1df942711d9a, 242, 92},
+    {0x924d692ca61be758, 269, 100},
+    {0xda01ee641a708dea, 295, 108},
+    {0xa26da3999aef774a, 322, 116},
+    {0xf209787bb47d6b85, 348, 124},
+    {0xb454e4a179dd1877, 375, 132},
+    {0x865b86925b9bc5c2, 402, 140},
+    {0xc83553c5c8965d3d, 428, 148},
+    {0x952ab45cfa97a0b3, 455, 156},
+    {0xde469fbd99a05fe3, 481, 164},
+    {0xa59bc234db398c25, 508, 172},
+    {0xf6c69a72a3989f5c, 534, 180},
+    {0xb7dcbf5354e9bece, 561, 188},
+    {0x88fcf317f22241e2, 588, 196},
+    {0xcc20ce9bd35c78a5, 614, 204},
+    {0x98165af37b2153df, 641, 212},
+    {0xe2a0b5dc971f303a, 667, 220},
+    {0xa8d9d1535ce3b396, 694, 228},
+    {0xfb9b7cd9a4a7443c, 720, 236},
+    {0xbb764c4ca7a44410, 747, 244},
+    {0x8bab8eefb6409c1a, 774, 252},
+    {0xd01fef10a657842c, 800, 260},
+    {0x9b10a4e5e9913129, 827, 268},
+    {0xe7109bfba19c0c9d, 853, 276},
+    {0xac2820d9623bf429, 880, 284},
+    {0x80444b5e7aa7cf85, 907, 292},
+    {0xbf21e44003acdd2d, 933, 300},
+    {0x8e679c2f5e44ff8f, 960, 308},
+    {0xd433179d9c8cb841, 986, 316},
+    {0x9e19db92b4e31ba9, 1013, 324},
+    {0xeb96bf6ebadf77d9, 1039, 332},
+    {0xaf87023b9bf0ee6b, 1066, 340},
+};
+
+#define CACHED_POWERS_COUNT (int)(sizeof(cachedPowers) / sizeof(CachedPower))
+#define CACHED_POWERS_FIRST -348  // k of the first
+#define CACHED_POWERS_STEP 8
+
+// The scaled numbers' exponent has to end up in this range, for the digits to
+// come out of their integral part and fractional part with plain arithmetic.
+#define MIN_TARGET_EXPONENT -60
+#define MAX_TARGET_EXPONENT -32
+
+#define DOUBLE_HIDDEN_BIT (UINT64_C(1) << 52)
+#define DOUBLE_FRACTION_MASK (DOUBLE_HIDDEN_BIT - 1)
+#define DOUBLE_EXPONENT_BIAS (0x3ff + 52)
+
+// The upper 64 bits of the 128-bit product, rounded.
+static DiyFp multiply(DiyFp a, DiyFp b) {
+    uint64_t aHigh = a.f >> 32, aLow = a.f & 0xffffffff;
+    uint64_t bHigh = b.f >> 32, bLow = b.f & 0xffffffff;
+    uint64_t highHigh = aHigh * bHigh;
+    uint64_t highLow = aHigh * bLow;
+    uint64_t lowHigh = aLow * bHigh;
+    uint64_t lowLow = aLow * bLow;
+    uint64_t middle = (lowLow >> 32) + (highLow & 0xffffffff) +
+                      (lowHigh & 0xffffffff) + (UINT64_C(1) << 31);
+    return (DiyFp){highHigh + (highLow >> 32) + (lowHigh >> 32) +
+                       (middle >> 32),
+                   a.e + b.e + 64};
+}
+
+// Shifts the significand up until its top bit is set.
+static DiyFp normalize(DiyFp x) {
+    while ((x.f & (UINT64_C(0x3ff) << 54)) == 0) {
+        x.f <<= 10;
+        x.e -= 10;
+    }
+    while ((x.f & (UINT64_C(1) << 63)) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// The cached power that scales a number with the given normalized exponent
+// into the target range.
+static const CachedPower* cachedPower(int e) {
+    // A guess at k from log10(2) ~ 78913 / 2^18, put right by the loops.
+    int minExponent = MIN_TARGET_EXPONENT - (e + 64);
+    int k = -((-(minExponent + 63) * 78913) >> 18);
+    int index = (k - CACHED_POWERS_FIRST - 1) / CACHED_POWERS_STEP + 1;
+    if (index < 0) index = 0;
+    if (index >= CACHED_POWERS_COUNT) index = CACHED_POWERS_COUNT - 1;
+    while (cachedPowers[index].e + e + 64 < MIN_TARGET_EXPONENT) index++;
+    while (cachedPowers[index].e + e + 64 > MAX_TARGET_EXPONENT) index--;
+    return &cachedPowers[index];
+}
+
+/*
+ * Makes the last digit as close to w as it can get while the digits still lie
+ * inside the boundaries, and says whether the result is certain to be right:
+ * all the distances are only known to within a unit or so.
+ *
+ * distanceTooHighW is how far the high boundary is above w, rest how far the
+ * digits are below it, and tenKappa what a unit of the last digit is worth.
+ */
+static bool roundWeed(char* digits, int count, uint64_t distanceTooHighW,
+                      uint64_t unsafeInterval, uint64_t rest,
+                      uint64_t tenKappa, uint64_t unit) {
+    uint64_t smallDistance = distanceTooHighW - unit;
+    uint64_t bigDistance = distanceTooHighW + unit;
+    while (rest < smallDistance && unsafeInterval - rest >= tenKappa &&
+           (rest + tenKappa < smallDistance ||
+            smallDistance - rest >= rest + tenKappa - smallDistance)) {
+        digits[count - 1]--;
+        rest += tenKappa;
+    }
+    // Rounding down once more would have made the digits closer for some
+    // number between the small and big distances, so it's ambiguous.
+    if (rest < bigDistance && unsafeInterval - rest >= tenKappa &&
+        (rest + tenKappa < bigDistance ||
+         bigDistance - rest > rest + tenKappa - bigDistance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafeInterval - 4 * unit;
+}
+
+/*
+ * Generates the shortest digits that lie between the scaled boundaries low and
+ * high, closest to w. They are widened by a unit for the error in scaling, so
+ * that nothing outside the real boundaries is missed, and roundWeed() rejects
+ * digits that may have landed outside of them.
+ *
+ * The digits are returned as an integer's, to be multiplied by 10^kappa.
+ */
+static bool generateDigits(DiyFp low, DiyFp w, DiyFp high, char* digits,
+                           int* count, int* kappa) {
+    uint64_t unit = 1;
+    uint64_t tooLow = low.f - unit;
+    uint64_t tooHigh = high.f + unit;
+    uint64_t unsafeInterval = tooHigh - tooLow;
+
+    // one is 1 at the scaled exponent, splitting tooHigh into its integral
+    // part and its fractional part.
+    int shift = -w.e;
+    uint64_t one = UINT64_C(1) << shift;
+    uint32_t integrals = (uint32_t)(tooHigh >> shift);
+    uint64_t fractionals = tooHigh & (one - 1);
+
+    uint32_t divisor = 1;
+    *kappa = 1;
+    while (divisor <= integrals / 10) {
+        divisor *= 10;
+        (*kappa)++;
+    }
+
+    *count = 0;
+    while (*kappa > 0) {
+        digits[(*count)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafeInterval) {
+            return roundWeed(digits, *count, tooHigh - w.f, unsafeInterval,
+                             rest, (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+
+    // The integral part is used up, every digit from here on is worth a tenth
+    // of the one before it, and so is the unit of error.
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafeInterval *= 10;
+        digits[(*count)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        (*kappa)--;
+        if (fractionals < unsafeInterval) {
+            return roundWeed(digits, *count, (tooHigh - w.f) * unit,
+                             unsafeInterval, fractionals, one, unit);
+        }
+    }
+}
+
+/*
+ * The shortest digits of a positive, finite number, and where its decimal
+ * point goes: the number is 0.digits * 10^point.
+ */
+static bool grisu3(double number, char* digits, int* count, int* point) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    uint64_t fraction = bits & DOUBLE_FRACTION_MASK;
+    int biasedExponent = (int)(bits >> 52) & 0x7ff;
+
+    DiyFp v;
+    if (biasedExponent == 0) {  // Subnormal
+        v = (DiyFp){fraction, 1 - DOUBLE_EXPONENT_BIAS};
+    } else {
+        v = (DiyFp){fraction | DOUBLE_HIDDEN_BIT,
+                    biasedExponent - DOUBLE_EXPONENT_BIAS};
+    }
+
+    // The boundaries are halfway to the neighboring doubles. The one below is
+    // closer when v is a power of two, the spacing halves under it.
+    DiyFp high = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp low;
+    if (fraction == 0 && biasedExponent > 1) {
+        low = (DiyFp){(v.f << 2) - 1, v.e - 2};
+    } else {
+        low = (DiyFp){(v.f << 1) - 1, v.e - 1};
+    }
+    low.f <<= low.e - high.e;
+    low.e = high.e;
+    DiyFp w = normalize(v);  // Has high's exponent as well
+
+    const CachedPower* power = cachedPower(w.e);
+    DiyFp scale = {power->f, power->e};
+    int kappa;
+    if (!generateDigits(multiply(low, scale), multiply(w, scale),
+                        multiply(high, scale), digits, count, &kappa)) {
+        return false;
+    }
+    *point = *count + kappa - power->k;
+    return true;
+}
+
+/*
+ * For the numbers Grisu3 isn't sure about: the shortest digits printf rounds
+ * the number to that read back as the number. Those tend to be long, so it
+ * starts from the 17 digits that always do, and takes off one at a time.
+ */
+static void slowDigits(double number, char* digits, int* count, int* point) {
+    char chars[NUMBER_CHARS_MAX];
+    char shorter[NUMBER_CHARS_MAX];
+    snprintf(chars, sizeof(chars), "%.16e", number);
+    for (int precision = 16; precision >= 1; precision--) {
+        snprintf(shorter, sizeof(shorter), "%.*e", precision - 1, number);
+        if (strtod(shorter, NULL) != number) break;
+        memcpy(chars, shorter, sizeof(chars));
+    }
+
+    // chars is d.ddde+xx, or de+xx
+    char* exponent = strchr(chars, 'e');
+    *count = 0;
+    for (char* c = chars; c < exponent; c++) {
+        if (*c != '.') digits[(*count)++] = *c;
+    }
+    while (*count > 1 && digits[*count - 1] == '0') (*count)--;
+    *point = atoi(exponent + 1) + 1;
+}
+
+// Writes an integer's digits, and returns how many there are.
+static int writeDigits(uint64_t integer, char* chars) {
+    char reversed[20];
+    int count = 0;
+    do {
+        reversed[count++] = (char)('0' + integer % 10);
+        integer /= 10;
+    } while (integer != 0);
+    for (int i = 0; i < count; i++) chars[i] = reversed[count - 1 - i];
+    return count;
+}
+
+int formatInteger(int64_t integer, char* chars) {
+    int length = 0;
+    uint64_t magnitude = (uint64_t)integer;
+    if (integer < 0) {
+        chars[length++] = '-';
+        magnitude = -magnitude;
+    }
+    length += writeDigits(magnitude, chars + length);
+    chars[length] = '\0';
+    return length;
+}
+
+int formatNumber(double number, char* chars) {
+    if (isnan(number)) {
+        return sprintf(chars, signbit(number) ? "-nan" : "nan");
+    }
+    if (isinf(number)) return sprintf(chars, number < 0 ? "-inf" : "inf");
+    if (number == 0) return sprintf(chars, signbit(number) ? "-0" : "0");
+
+    // Integers that doubles hold exactly are their own shortest digits.
+    if (number > -0x1p53 && number < 0x1p53 &&
+        number == (double)(int64_t)number) {
+        return formatInteger((int64_t)number, chars);
+    }
+
+    int length = 0;
+    if (number < 0) {
+        chars[length++] = '-';
+        number = -number;
+    }
+    char digits[NUMBER_CHARS_MAX];
+    int count;
+    int point;
+    if (!grisu3(number, digits, &count, &point)) {
+        slowDigits(number, digits, &count, &point);
+    }
+
+    if (count <= point && point <= 21) {
+        // An integer, with zeros after the digits.
+        memcpy(chars + length, digits, (size_t)count);
+        length += count;
+        for (int i = count; i < point; i++) chars[length++] = '0';
+    } else if (0 < point && point <= 21) {
+        // The point somewhere among the digits.
+        memcpy(chars + length, digits, (size_t)point);
+        length += point;
+        chars[length++] = '.';
+        memcpy(chars + length, digits + point, (size_t)(count - point));
+        length += count - point;
+    } else if (-6 < point && point <= 0) {
+        // Zeros between the point and the digits.
+        chars[length++] = '0';
+        chars[length++] = '.';
+        for (int i = point; i < 0; i++) chars[length++] = '0';
+        memcpy(chars + length, digits, (size_t)count);
+        length += count;
+    } else {
+        chars[length++] = digits[0];
+        if (count > 1) {
+            chars[length++] = '.';
+            memcpy(chars + length, digits + 1, (size_t)(count - 1));
+            length += count - 1;
+        }
+        int exponent = point - 1;
+        chars[length++] = 'e';
+        chars[length++] = exponent < 0 ? '-' : '+';
+        length += writeDigits((uint64_t)abs(exponent), chars + length);
+    }
+    chars[length] = '\0';
+    return length;
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+/*
+ * Turns numbers into text, the shortest that reads back as the same number.
+ *
+ * The digits come from Grisu3 (Loitsch, "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers", 2010), which needs nothing wider than
+ * 64-bit integers and a table of cached powers of ten. For about one number in
+ * 250 it can't tell whether its digits are the shortest, and those are left to
+ * printf, with ever more digits until they read back. Integers skip all of
+ * that.
+ *
+ * Numbers are laid out the way JavaScript lays them out: in plain decimal from
+ * 1e-6 up to 1e21, in exponent notation otherwise.
+ */
+
+#ifndef clox_dtoa_h
+#define clox_dtoa_h
+
+#include "common.h"
+
+// The longest text a number can come out as, like -1.2345678901234567e-308,
+// and its terminator.
+#define NUMBER_CHARS_MAX 32
+
+// Both write the text and a terminator to chars, and return its length.
+int formatNumber(double number, char* chars);
+int formatInteger(int64_t integer, char* chars);
+
+#endif
\ No newline at end of file
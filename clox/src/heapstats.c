@@ -0,0 +1,44 @@
+#include "heapstats.h"
+
+#include <string.h>
+
+void initHeapStats(HeapStats* stats) { memset(stats, 0, sizeof(HeapStats)); }
+
+const char* memoryKindName(MemoryKind kind) {
+    static const char* names[MEM_KIND_COUNT] = {
+        [OBJ_BOUND_METHOD] = "bound methods",
+        [OBJ_CLASS] = "classes",
+        [OBJ_CLOSURE] = "closures",
+        [OBJ_FUNCTION] = "functions",
+        [OBJ_INSTANCE] = "instances",
+        [OBJ_NATIVE] = "natives",
+        [OBJ_SHAPE] = "shapes",
+        [OBJ_STRING] = "strings",
+        [OBJ_TASK] = "tasks",
+        [OBJ_UPVALUE] = "upvalues",
+        [MEM_CHUNK] = "chunk code",
+        [MEM_CONSTANTS] = "constants",
+        [MEM_STRINGS] = "string chars",
+        [MEM_TABLES] = "table entries",
+        [MEM_FIELDS] = "overflow fields",
+        [MEM_STACK] = "stack",
+        [MEM_COMPILER] = "compiler",
+        [MEM_COPIES] = "copy maps",
+        [MEM_NURSERY] = "nursery",
+        [MEM_NONE] = "untracked",
+    };
+    return names[kind];
+}
+
+void printHeapStats(const HeapStats* stats, FILE* out) {
+    fprintf(out, "%-16s %12s %12s %12s %10s\n", "kind", "allocated",
+            "freed", "live", "count");
+    for (int kind = 0; kind < MEM_KIND_COUNT; kind++) {
+        const MemoryUsage* usage = &stats->kinds[kind];
+        if (usage->allocated == 0) continue;
+        fprintf(out, "%-16s %12zu %12zu %12zu %10zu\n",
+                memoryKindName((MemoryKind)kind), usage->allocated,
+                usage->freed, usage->allocated - usage->freed, usage->count);
+    }
+    fprintf(out, "live %zu bytes, peak %zu bytes\n", stats->live, stats->peak);
+}
\ No newline at end of file
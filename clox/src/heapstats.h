@@ -0,0 +1,70 @@
+/*
+ * Heap statistics: what a VM allocates, by kind of memory.
+ *
+ * Every allocation through reallocate() says what it is for. Objects are
+ * counted by their type, and the arrays hanging off them and off the VM by
+ * what they hold. Growing or shrinking a block counts the difference as
+ * allocated or freed, but only a new block counts as an allocation.
+ *
+ * Young objects are bump allocated in the nursery instead, see memory.c.
+ * They are counted apart, and the nursery itself isn't part of the heap. The
+ * ones that survive are copied to the heap, where they count again.
+ */
+
+#ifndef clox_heapstats_h
+#define clox_heapstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Kinds below OBJ_TYPE_COUNT are the objects of that ObjType.
+typedef enum {
+    MEM_CHUNK = OBJ_TYPE_COUNT,  // Bytecode and the tables alongside it
+    MEM_CONSTANTS,               // Constant tables of chunks
+    MEM_STRINGS,                 // Characters of strings
+    MEM_TABLES,                  // Entries of hash tables
+    MEM_FIELDS,                  // Fields of instances that don't fit inline
+    MEM_STACK,                   // The value stack, frames and open upvalues
+    MEM_COMPILER,                // What the compiler needs while it runs
+    MEM_COPIES,                  // What copying values between VMs needs
+    MEM_NURSERY,                 // Young objects
+    MEM_NONE,                    // Not in any VM's heap, with a NULL vm
+    MEM_KIND_COUNT
+} MemoryKind;
+
+// The kind of objects of the given ObjType.
+#define MEM_OBJECT(type) ((MemoryKind)(type))
+
+typedef struct {
+    size_t allocated;  // Bytes
+    size_t freed;      // Bytes
+    size_t count;      // Blocks allocated
+} MemoryUsage;
+
+typedef struct {
+    MemoryUsage kinds[MEM_KIND_COUNT];
+    size_t live;  // Bytes in the heap, as the collector counts them
+    size_t peak;  // The most there ever were
+} HeapStats;
+
+void initHeapStats(HeapStats* stats);
+const char* memoryKindName(MemoryKind kind);
+
+// Counts a block reallocated from oldSize to newSize bytes.
+static inline void countReallocation(HeapStats* stats, MemoryKind kind,
+                                     size_t oldSize, size_t newSize) {
+    MemoryUsage* usage = &stats->kinds[kind];
+    if (newSize > oldSize) {
+        usage->allocated += newSize - oldSize;
+    } else {
+        usage->freed += oldSize - newSize;
+    }
+    if (oldSize == 0 && newSize > 0) usage->count++;
+}
+
+// Prints a table of the kinds that were ever allocated.
+void printHeapStats(const HeapStats* stats, FILE* out);
+
+#endif
\ No newline at end of file
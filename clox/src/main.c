@@ -1,13 +1,35 @@
+// open_memstream(), fileno() and isatty() are POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
 #include "vm.h"
 
-static void repl() {
+// How every VM is set up, from the command line.
+typedef struct {
+    long gcPauseUs;
+    size_t heapLimit;
+    uint64_t stepLimit;
+    long timeLimitUs;
+    uint64_t quantum;
+} Settings;
+
+static void applySettings(VM* vm, const Settings* settings) {
+    vm->gcPauseUs = settings->gcPauseUs;
+    vm->heapLimit = settings->heapLimit;
+    vm->stepLimit = settings->stepLimit;
+    vm->timeLimitUs = settings->timeLimitUs;
+    vm->quantum = settings->quantum;
+}
+
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -17,11 +39,16 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        InterpretResult result = interpret(vm, line);
+        while (result == INTERPRET_YIELD) result = resumeVM(vm);
     }
 }
 
-static char* readFile(const char* path) {
+/*
+ * Reads a whole file, or returns NULL after telling err why it couldn't, if err
+ * isn't NULL.
+ */
+static char* readFile(FILE* err, const char* path) {
     /*
      * We want to allocate a big enough string to read the entire file, but we
      * don't know how big the file is until we've read it. The solution here is
@@ -32,8 +59,8 @@ static char* readFile(const char* path) {
 
     // File is not there
     if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%a\".\n", path);
-        exit(74);
+        if (err != NULL) fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
     }
 
     fseek(file, 0L, SEEK_END);
@@ -43,14 +70,19 @@ static char* readFile(const char* path) {
     char* buffer = (char*)malloc(fileSize + 1);
     // Run out of memory
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        if (err != NULL) {
+            fprintf(err, "Not enough memory to read \"%s\".\n", path);
+        }
+        fclose(file);
+        return NULL;
     }
 
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        if (err != NULL) fprintf(err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
     }
     buffer[bytesRead] = '\0';
 
@@ -58,30 +90,397 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
+static int exitCode(InterpretResult result) {
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+/*
+ * Runs a script and returns the process exit code it calls for, 0 if it ran
+ * fine.
+ */
+static int runFile(VM* vm, const char* path) {
+    char* source = readFile(vm->err, path);
+    if (source == NULL) return 74;
+    InterpretResult result = interpret(vm, source);
+    while (result == INTERPRET_YIELD) result = resumeVM(vm);
     /*
      * We can only free the source code when we are done with interpreting to
      * ensure the source is alive for use in the compiler/interpreter
      */
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    return exitCode(result);
+}
+
+/*
+ * Batch mode runs many scripts on a pool of worker threads. Every script gets
+ * a VM of its own, which shares nothing with the others, and its output is
+ * captured in memory so that it can be reported in the order the scripts were
+ * given no matter which finishes first.
+ */
+typedef struct {
+    const char* path;
+    char* source;  // Read up front, NULL if that failed
+    char* output;  // What the script printed
+    size_t outputSize;
+    char* errors;  // Its compile and runtime errors
+    size_t errorsSize;
+    int status;  // Exit code runFile() returned
+    bool done;
+
+    // While it runs.
+    VM vm;
+    FILE* out;
+    FILE* err;
+    InterpretResult result;  // Of the last run, which may have yielded
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int count;
+    Settings settings;   // For every VM
+    SharedHeap strings;  // Identifiers and literals of every script
+    Scheduler* tasks;    // One pool for the tasks of every script
+    int next;            // The next job a worker picks up
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  // Signalled whenever a job is done
+} Batch;
+
+// Scripts a worker keeps going at once, taking turns as they yield.
+#define WORKER_SCRIPTS_MAX 64
+
+/*
+ * Opens the streams a job's output is captured in. If it can't, the job is
+ * left without any, and the main thread reports that in its turn: other
+ * workers may be in the middle of their scripts.
+ */
+static bool openJobOutput(Job* job) {
+    job->out = open_memstream(&job->output, &job->outputSize);
+    job->err = open_memstream(&job->errors, &job->errorsSize);
+    if (job->out != NULL && job->err != NULL) return true;
+
+    if (job->out != NULL) fclose(job->out);
+    if (job->err != NULL) fclose(job->err);
+    free(job->output);
+    free(job->errors);
+    job->output = NULL;
+    job->outputSize = 0;
+    job->errors = NULL;
+    job->errorsSize = 0;
+    return false;
+}
+
+// Sets up the VM of a job and starts its script. Returns whether it's done.
+static bool startJob(Batch* batch, Job* job) {
+    initSharedVM(&job->vm, &batch->strings);
+    applySettings(&job->vm, &batch->settings);
+    job->vm.scheduler = batch->tasks;
+    job->vm.out = job->out;
+    job->vm.err = job->err;
+    if (job->source == NULL) {
+        // Read it again to report why it can't be.
+        job->status = runFile(&job->vm, job->path);
+        return true;
+    }
+    job->result = interpret(&job->vm, job->source);
+    return job->result != INTERPRET_YIELD;
+}
+
+// Hands a job over to the main thread to report.
+static void endJob(Batch* batch, Job* job) {
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void finishJob(Batch* batch, Job* job) {
+    if (job->source != NULL) {
+        job->status = exitCode(job->result);
+        free(job->source);
+    }
+    freeVM(&job->vm);
+    fclose(job->out);
+    fclose(job->err);
+    endJob(batch, job);
+}
+
+/*
+ * Runs jobs until there are none left. With a quantum, the scripts yield
+ * every so often, and up to WORKER_SCRIPTS_MAX of them take turns on the
+ * worker's thread, so that a long one doesn't hold up the ones after it.
+ */
+static void* worker(void* arg) {
+    Batch* batch = (Batch*)arg;
+    Job* running[WORKER_SCRIPTS_MAX];
+    int runningCount = 0;
+    bool jobsLeft = true;
+    for (;;) {
+        while (jobsLeft && runningCount < WORKER_SCRIPTS_MAX) {
+            pthread_mutex_lock(&batch->lock);
+            int index = batch->next++;
+            pthread_mutex_unlock(&batch->lock);
+            if (index >= batch->count) {
+                jobsLeft = false;
+                break;
+            }
+
+            Job* job = &batch->jobs[index];
+            if (!openJobOutput(job)) {
+                free(job->source);
+                job->status = 74;
+                endJob(batch, job);
+            } else if (startJob(batch, job)) {
+                finishJob(batch, job);
+            } else {
+                running[runningCount++] = job;
+            }
+        }
+        if (runningCount == 0) return NULL;
+
+        for (int i = 0; i < runningCount;) {
+            Job* job = running[i];
+            job->result = resumeVM(&job->vm);
+            if (job->result == INTERPRET_YIELD) {
+                i++;
+            } else {
+                finishJob(batch, job);
+                running[i] = running[--runningCount];
+            }
+        }
+    }
+}
+
+/*
+ * Runs the scripts at paths with the given number of worker threads and
+ * returns the highest exit code any of them called for.
+ */
+static int runBatch(const char** paths, int count, int threadCount,
+                    const Settings* settings) {
+    Batch batch;
+    batch.jobs = (Job*)calloc(count, sizeof(Job));
+    if (batch.jobs == NULL) {
+        fprintf(stderr, "Not enough memory to run %d scripts.\n", count);
+        exit(74);
+    }
+    for (int i = 0; i < count; i++) batch.jobs[i].path = paths[i];
+    batch.count = count;
+    batch.settings = *settings;
+
+    // Intern the strings the scripts have in common once, up front, instead of
+    // in every worker's VM. Scripts that can't be read fail later, in order.
+    initSharedHeap(&batch.strings);
+    for (int i = 0; i < count; i++) {
+        Job* job = &batch.jobs[i];
+        job->source = readFile(NULL, job->path);
+        if (job->source != NULL) internSource(&batch.strings, job->source);
+    }
+    freezeSharedHeap(&batch.strings);
+    // A pool of its own for every script that spawns would be a thread per
+    // core for each worker.
+    batch.tasks = newScheduler();
+
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    if (threadCount > count) threadCount = count;
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * threadCount);
+    if (threads == NULL) {
+        fprintf(stderr, "Not enough memory to start %d threads.\n",
+                threadCount);
+        exit(74);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &batch) != 0) {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(71);
+        }
+    }
+
+    // Report each script as soon as it and every script before it are done,
+    // so that a long batch streams its output instead of holding all of it.
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        Job* job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done) pthread_cond_wait(&batch.finished, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        if (job->output != NULL) {
+            fwrite(job->output, sizeof(char), job->outputSize, stdout);
+        }
+        if (job->status != 0) {
+            fflush(stdout);
+            fprintf(stderr, "[%s]\n", job->path);
+            if (job->errors != NULL) {
+                fwrite(job->errors, sizeof(char), job->errorsSize, stderr);
+            } else {
+                fprintf(stderr, "Not enough memory to run it.\n");
+            }
+        }
+        if (job->status > status) status = job->status;
+        free(job->output);
+        free(job->errors);
+    }
+
+    for (int i = 0; i < threadCount; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    stopScheduler(batch.tasks);
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+    freeSharedHeap(&batch.strings);
+    free(batch.jobs);
+    return status;
+}
+
+/*
+ * Splits a manifest, one script path per line, into paths. Blank lines are
+ * skipped. The paths point into manifest, which is modified in place.
+ */
+static const char** readManifest(char* manifest, int* count) {
+    int capacity = 0;
+    const char** paths = NULL;
+    *count = 0;
+
+    char* line = manifest;
+    while (*line != '\0') {
+        char* end = line + strcspn(line, "\r\n");
+        bool last = *end == '\0';
+        *end = '\0';
+        if (*line != '\0') {
+            if (*count == capacity) {
+                capacity = capacity < 8 ? 8 : capacity * 2;
+                paths = (const char**)realloc(paths,
+                                              sizeof(const char*) * capacity);
+                if (paths == NULL) {
+                    fprintf(stderr, "Not enough memory to read manifest.\n");
+                    exit(74);
+                }
+            }
+            paths[(*count)++] = line;
+        }
+        if (last) break;
+        line = end + 1;
+    }
+    return paths;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: clox [options] [--profile file] [--heap-stats] [path]\n"
+            "       clox [options] --jobs N [--manifest file] [path...]\n"
+            "Options: --gc-pause-us N, --heap-limit-mb N, --max-steps N, "
+            "--time-limit-ms N, --quantum N\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    int jobs = 0;
+    const char* manifestPath = NULL;
+    Settings settings = {0, HEAP_UNLIMITED, 0, 0, 0};
+    const char* profilePath = NULL;
+    bool heapStats = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            jobs = atoi(argv[++arg]);
+            if (jobs <= 0) usage();
+        } else if (strcmp(argv[arg], "--manifest") == 0 && arg + 1 < argc) {
+            manifestPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--gc-pause-us") == 0 && arg + 1 < argc) {
+            settings.gcPauseUs = atol(argv[++arg]);
+            if (settings.gcPauseUs <= 0) usage();
+        } else if (strcmp(argv[arg], "--heap-limit-mb") == 0 &&
+                   arg + 1 < argc) {
+            long megabytes = atol(argv[++arg]);
+            if (megabytes <= 0) usage();
+            settings.heapLimit = (size_t)megabytes * 1024 * 1024;
+        } else if (strcmp(argv[arg], "--max-steps") == 0 && arg + 1 < argc) {
+            long long steps = atoll(argv[++arg]);
+            if (steps <= 0) usage();
+            settings.stepLimit = (uint64_t)steps;
+        } else if (strcmp(argv[arg], "--time-limit-ms") == 0 &&
+                   arg + 1 < argc) {
+            long milliseconds = atol(argv[++arg]);
+            if (milliseconds <= 0) usage();
+            settings.timeLimitUs = milliseconds * 1000;
+        } else if (strcmp(argv[arg], "--quantum") == 0 && arg + 1 < argc) {
+            long long steps = atoll(argv[++arg]);
+            if (steps <= 0) usage();
+            settings.quantum = (uint64_t)steps;
+        } else if (strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc) {
+            profilePath = argv[++arg];
+        } else if (strcmp(argv[arg], "--heap-stats") == 0) {
+            heapStats = true;
+        } else {
+            usage();
+        }
+    }
+
+    if (jobs > 0 || manifestPath != NULL) {
+        // Only one VM can be sampled, or report its heap.
+        if (profilePath != NULL || heapStats) usage();
+        if (jobs == 0) jobs = 1;
+        const char** paths = argv + arg;
+        int count = argc - arg;
+        if (count == 0 && manifestPath == NULL) usage();
+        char* manifest = NULL;
+        if (manifestPath != NULL) {
+            if (count > 0) usage();
+            manifest = readFile(stderr, manifestPath);
+            if (manifest == NULL) exit(74);
+            paths = readManifest(manifest, &count);
+        }
+
+        int status = count > 0 ? runBatch(paths, count, jobs, &settings) : 0;
+        if (manifest != NULL) {
+            free((void*)paths);
+            free(manifest);
+        }
+        return status;
+    }
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (arg < argc - 1) usage();
+
+    // The folded stacks go to the profile, the hottest lines to stderr.
+    FILE* profile = NULL;
+    if (profilePath != NULL) {
+        profile = fopen(profilePath, "w");
+        if (profile == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", profilePath);
+            exit(74);
+        }
+    }
+
+    VM vm;
+    initVM(&vm);
+    applySettings(&vm, &settings);
+    // Someone is watching a terminal, lines show up as they are printed.
+    if (isatty(fileno(stdout))) vm.output.mode = OUTPUT_LINE;
+    if (profile != NULL && !startSampler(&vm)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(71);
+    }
+
+    int status = 0;
+    if (arg == argc) {
+        repl(&vm);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(&vm, argv[arg]);
     }
 
-    freeVM();
-}
+    if (profile != NULL) {
+        stopSampler(&vm, profile);
+        fclose(profile);
+    }
+    if (heapStats) {
+        HeapStats stats;
+        getHeapStats(&vm, &stats);
+        printHeapStats(&stats, vm.err);
+    }
+    freeVM(&vm);
+    return status;
+}
\ No newline at end of file
@@ -1,13 +1,81 @@
+// sysconf() and sched_yield() are POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
 #include "memory.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "compiler.h"
+#include "task.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
+// Heaps smaller than this are marked by a single thread, the others with up
+// to one thread per core.
+#define GC_PARALLEL_MIN (8 * 1024 * 1024)
+#define GC_MARKERS_MAX 8
+// Objects swept by each allocation while a sweep is pending.
+#define GC_SWEEP_SLICE 64
+
+#define NURSERY_SIZE (256 * 1024)
+// Bigger objects are allocated in the old space right away.
+#define NURSERY_OBJECT_MAX (NURSERY_SIZE / 16)
+// Room kept free for what runs between safe points, past the limit.
+#define NURSERY_SLACK (NURSERY_SIZE / 8)
+#define NURSERY_ALIGN 8
+
+// An incremental collection takes a step every time this much is allocated,
+// and checks whether its time is up after tracing so many objects.
+#define GC_STEP_BYTES (32 * 1024)
+#define GC_STEP_CLOCK_EVERY 64
+
+static void sweepSlice(VM* vm, int count);
+
 /*
  * Handles (all) dynamic memory allocation for clox
+ *
+ * vm is the VM the memory is for, or NULL for memory shared between VMs,
+ * which is neither counted nor collected.
+ *
+ * A VM's heap may be limited. Allocations can't fail where they are made, the
+ * code making them has no way to back out, so the heap going past the limit
+ * only sets vm->outOfMemory. The interpreter checks that at its safe points,
+ * and fails with a runtime error if a full collection doesn't bring the heap
+ * back under the limit. A limit well below the memory there is keeps a
+ * runaway script from taking the process down with it: memory running out
+ * altogether still ends the process, after one last collection.
  */
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+void* reallocate(VM* vm, MemoryKind kind, void* pointer, size_t oldSize,
+                 size_t newSize) {
+    if (vm != NULL) {
+        vm->bytesAllocated += newSize - oldSize;
+        countReallocation(&vm->heapStats, kind, oldSize, newSize);
+        if (newSize > oldSize) {
+            if (vm->bytesAllocated > vm->heapStats.peak) {
+                vm->heapStats.peak = vm->bytesAllocated;
+            }
+#ifdef DEBUG_STRESS_GC
+            collectGarbage(vm);
+#else
+            if (vm->bytesAllocated > vm->nextGC) collectGarbage(vm);
+#endif
+            // Pay off the pending sweep a slice at a time.
+            if (vm->unswept != NULL) sweepSlice(vm, GC_SWEEP_SLICE);
+            if (vm->bytesAllocated > vm->heapLimit) vm->outOfMemory = true;
+        }
+    }
+
     // Handle deallocation by ourselves
     if (newSize == 0) {
         free(pointer);
@@ -18,32 +86,876 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     // We shrink or grow the allocation if there is capacity
     // Otherwise, allocate new space and return the pointer
     void* result = realloc(pointer, newSize);
+    if (result == NULL && vm != NULL) {
+        collectNow(vm);
+        result = realloc(pointer, newSize);
+    }
 
-    if (result == NULL) exit(1);  // In case not enough space
+    if (result == NULL) {  // In case not enough space
+        fprintf(vm != NULL ? vm->err : stderr,
+                "Out of memory allocating %zu bytes.\n", newSize);
+        exit(74);
+    }
     return result;
 }
 
+/*
+ * The mark phase.
+ *
+ * Marking is split between markers, each on its own thread, that trace the
+ * object graph from the gray objects on their stacks: objects known to be
+ * reachable whose references haven't been followed yet. Setting the mark bit
+ * is atomic, so every object is claimed by exactly one marker, and marking
+ * only reads the heap otherwise.
+ *
+ * A marker works off a private stack without locking. When it has work to
+ * spare while other markers are idle, it moves the older half of its stack to
+ * a shared stack, from which idle markers steal. Marking is done once every
+ * marker is idle, since only busy markers can hand out work.
+ */
+typedef struct {
+    int count;
+    int capacity;
+    Obj** objects;
+} GrayStack;
+
+typedef struct MarkPhase MarkPhase;
+
+struct Marker {
+    MarkPhase* phase;
+    GrayStack gray;
+    pthread_mutex_t lock;  // Guards shared
+    GrayStack shared;
+    atomic_int sharedCount;  // So that thieves can look without locking
+    pthread_t thread;
+};
+
+struct MarkPhase {
+    int markerCount;
+    Marker* markers;
+    atomic_int idle;  // Markers out of work
+    // While marking incrementally, the VM whose young objects are left for the
+    // final pause: a minor collection may move them before that.
+    VM* deferYoung;
+};
+
+// An incremental mark in progress, see collectGarbage().
+struct Marking {
+    MarkPhase phase;
+    Marker marker;
+    size_t limit;  // Past this many bytes allocated, marking is hurried along
+};
+
+// Gray stacks aren't part of the heap: collecting while they grow would
+// recurse.
+static void pushGray(GrayStack* stack, Obj* object) {
+    if (stack->capacity < stack->count + 1) {
+        int oldCapacity = stack->capacity;
+        stack->capacity = GROW_CAPACITY(oldCapacity);
+        stack->objects = GROW_ARRAY(NULL, MEM_NONE, Obj*, stack->objects,
+                                    oldCapacity, stack->capacity);
+    }
+    stack->objects[stack->count++] = object;
+}
+
+static void initMarker(Marker* marker, MarkPhase* phase) {
+    marker->phase = phase;
+    marker->gray.count = 0;
+    marker->gray.capacity = 0;
+    marker->gray.objects = NULL;
+    pthread_mutex_init(&marker->lock, NULL);
+    marker->shared.count = 0;
+    marker->shared.capacity = 0;
+    marker->shared.objects = NULL;
+    atomic_init(&marker->sharedCount, 0);
+}
+
+static void freeMarker(Marker* marker) {
+    FREE_ARRAY(NULL, MEM_NONE, Obj*, marker->gray.objects,
+               marker->gray.capacity);
+    FREE_ARRAY(NULL, MEM_NONE, Obj*, marker->shared.objects,
+               marker->shared.capacity);
+    pthread_mutex_destroy(&marker->lock);
+}
+
+void markObject(Marker* marker, Obj* object) {
+    if (object == NULL) return;
+    // Look before writing: objects shared between VMs are always marked, and
+    // must only ever be read.
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) return;
+    VM* deferYoung = marker->phase->deferYoung;
+    if (deferYoung != NULL && isYoung(deferYoung, object)) return;
+    if (atomic_exchange_explicit(&object->isMarked, true,
+                                 memory_order_relaxed)) {
+        return;  // Another marker got there first
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(stdout, OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    // Strings hold no references, there is nothing more to do for them.
+    if (object->type == OBJ_STRING) return;
+    pushGray(&marker->gray, object);
+}
+
+void markValue(Marker* marker, Value value) {
+    if (IS_OBJ(value)) markObject(marker, AS_OBJ(value));
+}
+
+static void markTable(Marker* marker, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        markObject(marker, (Obj*)entry->key);
+        markValue(marker, entry->value);
+    }
+}
+
+/*
+ * Follows the references of a gray object, which makes it black.
+ */
+static void blackenObject(Marker* marker, Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            markValue(marker, bound->receiver);
+            markValue(marker, bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            markObject(marker, (Obj*)klass->name);
+            markTable(marker, &klass->methods);
+            markObject(marker, (Obj*)klass->shape);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            markObject(marker, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                markValue(marker, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject(marker, (Obj*)function->name);
+            ValueArray* constants = &function->chunk.constants;
+            for (int i = 0; i < constants->count; i++) {
+                markValue(marker, constants->values[i]);
+            }
+            // What the inline caches have seen stays alive while cached.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    markObject(marker, (Obj*)cache->entries[j].shape);
+                    markObject(marker, (Obj*)cache->entries[j].next);
+                    markValue(marker, cache->entries[j].method);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            markObject(marker, (Obj*)instance->klass);
+            markObject(marker, (Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(marker, *instanceField(instance, i));
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+            markObject(marker, (Obj*)((ObjNative*)object)->name);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject(marker, (Obj*)shape->parent);
+            markObject(marker, (Obj*)shape->name);
+            markTable(marker, &shape->fields);
+            markTable(marker, &shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE:
+            markValue(marker, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_STRING:
+        case OBJ_TASK:
+            // The task's objects are in the heap of its own VM.
+            break;
+    }
+}
+
+/*
+ * Hands the older half of the marker's gray objects to idle markers.
+ */
+static void shareWork(Marker* marker) {
+    int half = marker->gray.count / 2;
+    pthread_mutex_lock(&marker->lock);
+    for (int i = 0; i < half; i++) {
+        pushGray(&marker->shared, marker->gray.objects[i]);
+    }
+    atomic_store(&marker->sharedCount, marker->shared.count);
+    pthread_mutex_unlock(&marker->lock);
+
+    marker->gray.count -= half;
+    for (int i = 0; i < marker->gray.count; i++) {
+        marker->gray.objects[i] = marker->gray.objects[i + half];
+    }
+}
+
+/*
+ * Moves up to half (but at least one) of victim's shared gray objects to
+ * marker's own stack.
+ */
+static bool stealWork(Marker* marker, Marker* victim) {
+    if (atomic_load(&victim->sharedCount) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int count = victim->shared.count;
+    int take = victim == marker ? count : (count + 1) / 2;
+    for (int i = 0; i < take; i++) {
+        pushGray(&marker->gray, victim->shared.objects[--count]);
+    }
+    victim->shared.count = count;
+    atomic_store(&victim->sharedCount, count);
+    pthread_mutex_unlock(&victim->lock);
+    return take > 0;
+}
+
+// Takes back what the marker shared, or else steals from the others.
+static bool findWork(Marker* marker) {
+    MarkPhase* phase = marker->phase;
+    int self = (int)(marker - phase->markers);
+    for (int i = 0; i < phase->markerCount; i++) {
+        Marker* victim = &phase->markers[(self + i) % phase->markerCount];
+        if (stealWork(marker, victim)) return true;
+    }
+    return false;
+}
+
+static bool anyShared(MarkPhase* phase) {
+    for (int i = 0; i < phase->markerCount; i++) {
+        if (atomic_load(&phase->markers[i].sharedCount) > 0) return true;
+    }
+    return false;
+}
+
+static void* runMarker(void* arg) {
+    Marker* marker = (Marker*)arg;
+    MarkPhase* phase = marker->phase;
+    for (;;) {
+        while (marker->gray.count > 0) {
+            Obj* object = marker->gray.objects[--marker->gray.count];
+            blackenObject(marker, object);
+            if (marker->gray.count > 1 &&
+                atomic_load_explicit(&phase->idle, memory_order_relaxed) > 0 &&
+                atomic_load_explicit(&marker->sharedCount,
+                                     memory_order_relaxed) == 0) {
+                shareWork(marker);
+            }
+        }
+        if (findWork(marker)) continue;
+
+        atomic_fetch_add(&phase->idle, 1);
+        for (;;) {
+            if (atomic_load(&phase->idle) == phase->markerCount) return NULL;
+            // Only stop being idle for work that is actually there.
+            if (anyShared(phase)) {
+                atomic_fetch_sub(&phase->idle, 1);
+                if (findWork(marker)) break;
+                atomic_fetch_add(&phase->idle, 1);
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void markRoots(VM* vm, Marker* marker) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(marker, *slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = &vm->frames[i];
+        markObject(marker, (Obj*)frame->function);
+        // A method's receiver takes the closure's place on the stack. The
+        // frame still has its upvalues though, which live inside it.
+        if (frame->upvalues != NULL) {
+            markObject(marker, (Obj*)((char*)frame->upvalues -
+                                      offsetof(ObjClosure, upvalues)));
+        }
+    }
+
+    int slots = (int)(vm->stackTop - vm->stack);
+    for (int i = 0; i < slots; i++) {
+        markObject(marker, (Obj*)vm->openUpvalues[i]);
+    }
+
+    markTable(marker, &vm->globals);
+    markObject(marker, (Obj*)vm->initString);
+    markCompilerRoots(vm, marker);
+}
+
+/*
+ * Uses more threads the bigger the heap, since starting them isn't free.
+ */
+static int markerCount(VM* vm) {
+    if (vm->bytesAllocated < GC_PARALLEL_MIN) return 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    return cores < GC_MARKERS_MAX ? (int)cores : GC_MARKERS_MAX;
+}
+
+static void markHeap(VM* vm) {
+    MarkPhase phase;
+    Marker markers[GC_MARKERS_MAX];
+    phase.markerCount = markerCount(vm);
+    phase.markers = markers;
+    atomic_init(&phase.idle, 0);
+    phase.deferYoung = NULL;
+    for (int i = 0; i < phase.markerCount; i++) initMarker(&markers[i], &phase);
+
+    // This thread marks the roots, the others start out idle and steal.
+    markRoots(vm, &markers[0]);
+    int started = 1;
+    while (started < phase.markerCount) {
+        if (pthread_create(&markers[started].thread, NULL, runMarker,
+                           &markers[started]) != 0) {
+            break;
+        }
+        started++;
+    }
+    // Markers that didn't start never go busy, they count as idle.
+    atomic_fetch_add(&phase.idle, phase.markerCount - started);
+    runMarker(&markers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(markers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < phase.markerCount; i++) freeMarker(&markers[i]);
+}
+
 /*
  * Free the global object list for the vm.
  *
  * Traverse the global object list, free it, then move on to the next one.
  */
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
     switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            FREE(vm, MEM_OBJECT(OBJ_BOUND_METHOD), ObjBoundMethod, object);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            freeTable(vm, &klass->methods);
+            FREE(vm, MEM_OBJECT(OBJ_CLASS), ObjClass, object);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            reallocate(vm, MEM_OBJECT(OBJ_CLOSURE), object,
+                       sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount,
+                       0);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(vm, &function->chunk);
+            FREE(vm, MEM_OBJECT(OBJ_FUNCTION), ObjFunction, object);
+            break;
+        }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY(vm, MEM_STRINGS, char, string->chars,
+                       string->length + 1);
+            FREE(vm, MEM_OBJECT(OBJ_STRING), ObjString, object);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FREE_ARRAY(vm, MEM_FIELDS, Value, instance->overflow,
+                       instance->overflowCapacity);
+            reallocate(vm, MEM_OBJECT(OBJ_INSTANCE), object,
+                       sizeof(ObjInstance) +
+                           sizeof(Value) * instance->inlineCount,
+                       0);
+            break;
+        }
+        case OBJ_NATIVE:
+            FREE(vm, MEM_OBJECT(OBJ_NATIVE), ObjNative, object);
+            break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(vm, &shape->fields);
+            freeTable(vm, &shape->transitions);
+            FREE(vm, MEM_OBJECT(OBJ_SHAPE), ObjShape, object);
+            break;
+        }
+        case OBJ_TASK:
+            releaseTask(((ObjTask*)object)->task);
+            FREE(vm, MEM_OBJECT(OBJ_TASK), ObjTask, object);
+            break;
+        case OBJ_UPVALUE:
+            FREE(vm, MEM_OBJECT(OBJ_UPVALUE), ObjUpvalue, object);
+            break;
+    }
+}
+
+/*
+ * The sweep phase is lazy. A collection only detaches the list of objects it
+ * marked, and allocations sweep it a slice at a time afterwards, freeing what
+ * wasn't marked and moving the rest back onto the list of live objects.
+ * Objects allocated in the meantime go straight onto that list, unmarked.
+ */
+static void sweepSlice(VM* vm, int count) {
+    while (vm->unswept != NULL && count-- > 0) {
+        Obj* object = vm->unswept;
+        vm->unswept = object->next;
+        if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+            atomic_store_explicit(&object->isMarked, false,
+                                  memory_order_relaxed);
+            object->next = vm->objects;
+            vm->objects = object;
+        } else {
+            freeObject(vm, object);
+        }
+    }
+
+    // Only now is it known how much of the heap is live.
+    if (vm->unswept == NULL) {
+        vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+        if (vm->nextGC < GC_INITIAL_THRESHOLD) {
+            vm->nextGC = GC_INITIAL_THRESHOLD;
+        }
+    }
+}
+
+void finishSweep(VM* vm) {
+    while (vm->unswept != NULL) sweepSlice(vm, GC_SWEEP_SLICE);
+}
+
+/*
+ * The young generation.
+ *
+ * Most objects die young: the strings concatenation builds, instances that
+ * live for a single call, bound methods. Those are allocated by bumping a
+ * pointer through the nursery, a buffer of the VM's own, and are never freed
+ * one by one. A minor collection copies the ones still reachable out to the
+ * old space, where they are allocated like any other object, and the whole
+ * nursery is reused.
+ *
+ * A young object can only be reached from the stack, from another young
+ * object, or from an old object that the write barrier remembered when it
+ * came to point into the nursery. Global variables are remembered all
+ * together. Since minor collections move objects, they only happen at safe
+ * points of the interpreter, where no C code holds on to a young object: at
+ * calls and loop back edges, once the nursery is getting full. Until then,
+ * objects that don't fit go to the old space directly.
+ *
+ * The collector marks and frees young objects in place like old ones, except
+ * that it doesn't sweep them.
+ */
+Obj* allocateYoung(VM* vm, size_t size) {
+    size = (size + NURSERY_ALIGN - 1) & ~(size_t)(NURSERY_ALIGN - 1);
+    if (size > NURSERY_OBJECT_MAX) return NULL;
+
+    if (vm->nursery == NULL) {
+        // Reused rather than freed, so not counted as part of the heap.
+        vm->nursery = ALLOCATE(NULL, MEM_NONE, char, NURSERY_SIZE);
+        vm->nurseryTop = vm->nursery;
+        vm->nurseryEnd = vm->nursery + NURSERY_SIZE;
+#ifdef DEBUG_STRESS_GC
+        vm->nurseryLimit = vm->nursery;
+#else
+        vm->nurseryLimit = vm->nurseryEnd - NURSERY_SLACK;
+#endif
+    }
+
+    if ((size_t)(vm->nurseryEnd - vm->nurseryTop) < size) return NULL;
+    Obj* object = (Obj*)vm->nurseryTop;
+    vm->nurseryTop += size;
+    return object;
+}
+
+// Gives back the most recent young allocation.
+void releaseYoung(VM* vm, Obj* object) { vm->nurseryTop = (char*)object; }
+
+void rememberObject(VM* vm, Obj* object) {
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        int oldCapacity = vm->rememberedCapacity;
+        vm->rememberedCapacity = GROW_CAPACITY(oldCapacity);
+        vm->remembered = GROW_ARRAY(NULL, MEM_NONE, Obj*, vm->remembered,
+                                    oldCapacity, vm->rememberedCapacity);
+    }
+    object->isRemembered = true;
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+// A promoted young object is marked, and holds the address of its copy in
+// place of its first field.
+static Obj** forwardingAddress(Obj* object) { return (Obj**)(object + 1); }
+
+static size_t youngSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            return sizeof(ObjBoundMethod);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) +
+                   sizeof(Value) * ((ObjInstance*)object)->inlineCount;
+        default:
+            return 0;  // Strings are promoted separately
+    }
+}
+
+/*
+ * Copies a young object to the old space, the first time it is reached. The
+ * copies are left for promoteReferences() to go through.
+ */
+static Obj* promote(VM* vm, GrayStack* promoted, Obj* object) {
+    if (!isYoung(vm, object)) return object;
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+        return *forwardingAddress(object);
+    }
+
+    Obj* copy;
+    if (object->type == OBJ_STRING) {
+        // Old strings keep their characters in an array of their own.
+        ObjString* string = (ObjString*)object;
+        char* chars = ALLOCATE(vm, MEM_STRINGS, char, string->length + 1);
+        memcpy(chars, string->chars, string->length + 1);
+        ObjString* old = ALLOCATE(vm, MEM_OBJECT(OBJ_STRING), ObjString, 1);
+        memcpy(old, string, sizeof(ObjString));
+        old->chars = chars;
+        copy = (Obj*)old;
+    } else {
+        size_t size = youngSize(object);
+        copy = (Obj*)reallocate(vm, MEM_OBJECT(object->type), NULL, 0,
+                                size);
+        memcpy(copy, object, size);
+        pushGray(promoted, copy);
+    }
+    copy->next = vm->objects;
+    vm->objects = copy;
+
+    atomic_store_explicit(&object->isMarked, true, memory_order_relaxed);
+    *forwardingAddress(object) = copy;
+    // The objects pointing at the copy may have been marked already.
+    if (vm->marking != NULL) markObject(&vm->marking->marker, copy);
+    return copy;
+}
+
+static Value promoteValue(VM* vm, GrayStack* promoted, Value value) {
+    if (!IS_OBJ(value)) return value;
+    return OBJ_VAL(promote(vm, promoted, AS_OBJ(value)));
+}
+
+/*
+ * Promotes whatever an old object refers to in the nursery. Only fields that
+ * hold arbitrary values can.
+ */
+static void promoteReferences(VM* vm, GrayStack* promoted, Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            bound->receiver = promoteValue(vm, promoted, bound->receiver);
+            bound->method = promoteValue(vm, promoted, bound->method);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] =
+                    promoteValue(vm, promoted, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                Value* field = instanceField(instance, i);
+                *field = promoteValue(vm, promoted, *field);
+            }
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            upvalue->closed = promoteValue(vm, promoted, upvalue->closed);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Counts what was bump allocated since the nursery was last emptied, all of
+// it gone with the nursery.
+static void countYoung(VM* vm) {
+    size_t used = (size_t)(vm->nurseryTop - vm->nursery);
+    vm->heapStats.kinds[MEM_NURSERY].allocated += used;
+    vm->heapStats.kinds[MEM_NURSERY].freed += used;
+}
+
+/*
+ * Forgets the young objects, once those still reachable have been promoted.
+ * The intern table holds on to young strings weakly: it follows the ones that
+ * moved, and drops the others.
+ */
+static void resetNursery(VM* vm) {
+    for (Obj* object = vm->young; object != NULL; object = object->next) {
+        bool promoted =
+            atomic_load_explicit(&object->isMarked, memory_order_relaxed);
+        if (object->type == OBJ_STRING) {
+            ObjString* string = (ObjString*)object;
+            if (promoted) {
+                tableMoveKey(&vm->strings, string,
+                             (ObjString*)*forwardingAddress(object));
+            } else {
+                tableDelete(&vm->strings, string);
+            }
+        } else if (object->type == OBJ_INSTANCE && !promoted) {
+            ObjInstance* instance = (ObjInstance*)object;
+            FREE_ARRAY(vm, MEM_FIELDS, Value, instance->overflow,
+                       instance->overflowCapacity);
+        }
+    }
+
+    vm->young = NULL;
+    countYoung(vm);
+    vm->nurseryTop = vm->nursery;
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        vm->remembered[i]->isRemembered = false;
+    }
+    vm->rememberedCount = 0;
+    vm->youngGlobals = false;
+}
+
+/*
+ * A minor collection, which promotes every young object that is still
+ * reachable. Only call this at a safe point.
+ */
+void collectNursery(VM* vm) {
+    if (vm->young == NULL) return;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    // Promoting allocates, the old space must stay put meanwhile.
+    vm->gcPaused++;
+    GrayStack promoted = {0, 0, NULL};
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        *slot = promoteValue(vm, &promoted, *slot);
+    }
+    if (vm->youngGlobals) {
+        for (int i = 0; i < vm->globals.capacity; i++) {
+            Entry* entry = &vm->globals.entries[i];
+            if (entry->key == NULL) continue;
+            entry->value = promoteValue(vm, &promoted, entry->value);
+        }
+    }
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        promoteReferences(vm, &promoted, vm->remembered[i]);
+    }
+    while (promoted.count > 0) {
+        promoteReferences(vm, &promoted, promoted.objects[--promoted.count]);
+    }
+    FREE_ARRAY(NULL, MEM_NONE, Obj*, promoted.objects, promoted.capacity);
+    resetNursery(vm);
+    vm->gcPaused--;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm->bytesAllocated - before);
+#endif
+
+    // What was promoted may well be what tips the old space over.
+    if (vm->bytesAllocated > vm->nextGC) collectGarbage(vm);
+}
+
+void shadeObject(VM* vm, Obj* object) {
+    markObject(&vm->marking->marker, object);
+}
+
+static void freeMarking(VM* vm) {
+    freeMarker(&vm->marking->marker);
+    FREE(NULL, MEM_NONE, Marking, vm->marking);
+    vm->marking = NULL;
+}
+
+static long elapsedUs(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Traces gray objects for as long as the pause budget allows, and returns
+ * whether there are none left.
+ */
+static bool markStep(VM* vm) {
+    Marker* marker = &vm->marking->marker;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int traced = 1; marker->gray.count > 0; traced++) {
+        blackenObject(marker, marker->gray.objects[--marker->gray.count]);
+        if (traced % GC_STEP_CLOCK_EVERY == 0 &&
+            elapsedUs(&start) >= vm->gcPauseUs) {
             break;
         }
     }
+    return marker->gray.count == 0;
+}
+
+/*
+ * Does the marking of an incremental collection a step at a time. Returns
+ * whether it is done.
+ *
+ * Marking starts from the roots, and the write barrier shades whatever is
+ * stored into an object while it goes on, so no marked object ends up
+ * pointing at one that the marker won't find. Objects allocated meanwhile
+ * are left unmarked, bar what the nursery promotes. Whatever of them is still
+ * reachable, from the roots or the nursery, is marked in a final pause once
+ * the gray objects run out.
+ */
+static bool markIncrementally(VM* vm) {
+    if (vm->marking == NULL) {
+        finishSweep(vm);
+#ifdef DEBUG_LOG_GC
+        printf("-- gc begin marking\n");
+#endif
+        Marking* marking = ALLOCATE(NULL, MEM_NONE, Marking, 1);
+        marking->phase.markerCount = 1;
+        marking->phase.markers = &marking->marker;
+        atomic_init(&marking->phase.idle, 0);
+        marking->phase.deferYoung = vm;
+        initMarker(&marking->marker, &marking->phase);
+        marking->limit = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+        vm->marking = marking;
+        markRoots(vm, &marking->marker);
+    }
+
+    // A program that allocates faster than the steps can mark would otherwise
+    // keep the collection from ever finishing. Past the limit, the final pause
+    // marks whatever is left.
+    if (vm->bytesAllocated <= vm->marking->limit && !markStep(vm)) {
+        vm->nextGC = vm->bytesAllocated + GC_STEP_BYTES;
+        return false;
+    }
+
+    // The remembered objects are all that point into the nursery.
+    Marker* marker = &vm->marking->marker;
+    vm->marking->phase.deferYoung = NULL;
+    markRoots(vm, marker);
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj* object = vm->remembered[i];
+        if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+            blackenObject(marker, object);
+        }
+    }
+    runMarker(marker);
+    freeMarking(vm);
+    return true;
+}
+
+/*
+ * Collects the old space. Without a pause budget, all of the marking is done
+ * at once, in parallel for big heaps. With one, it is done incrementally.
+ * Either way, the sweep is done lazily afterwards.
+ */
+void collectGarbage(VM* vm) {
+    if (vm->gcPaused > 0) return;
+    // The functions in the samples may not live through the collection.
+    if (vm->sampler != NULL) drainSamples(vm);
+    if (vm->gcPauseUs > 0) {
+        if (!markIncrementally(vm)) return;
+    } else {
+        // The previous collection's marks have to be cleared first.
+        finishSweep(vm);
+#ifdef DEBUG_LOG_GC
+        printf("-- gc begin\n");
+#endif
+        markHeap(vm);
+    }
+
+    // A trace points into chunks that may be about to go away.
+    abortTrace(&vm->trace);
+    tableRemoveWhite(&vm->strings);
+
+    // The nursery isn't swept, its objects are unmarked right away. Remembered
+    // objects that were found dead are about to be.
+    for (Obj* object = vm->young; object != NULL; object = object->next) {
+        atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
+    }
+    int remembered = 0;
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj* object = vm->remembered[i];
+        if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+            vm->remembered[remembered++] = object;
+        }
+    }
+    vm->rememberedCount = remembered;
+
+    vm->unswept = vm->objects;
+    vm->objects = NULL;
+    // Until the sweep is done, allow for all of the heap still being live.
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   marked a heap of %zu bytes, next at %zu\n",
+           vm->bytesAllocated, vm->nextGC);
+#endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+/*
+ * A collection that is over by the time it returns, sweep and all, for when
+ * the heap has to shrink right away.
+ */
+void collectNow(VM* vm) {
+    if (vm->gcPaused > 0) return;
+    long gcPauseUs = vm->gcPauseUs;
+    if (vm->marking != NULL) {
+        vm->marking->limit = 0;  // Marks the rest in the final pause
+    } else {
+        vm->gcPauseUs = 0;
+    }
+    collectGarbage(vm);
+    vm->gcPauseUs = gcPauseUs;
+    finishSweep(vm);
+}
+
+void freeObjects(VM* vm) {
+    if (vm->marking != NULL) freeMarking(vm);
+    Obj* lists[] = {vm->objects, vm->unswept};
+    for (int i = 0; i < 2; i++) {
+        Obj* object = lists[i];
+        while (object != NULL) {
+            Obj* next = object->next;
+            freeObject(vm, object);
+            object = next;
+        }
+    }
+    vm->objects = NULL;
+    vm->unswept = NULL;
+
+    for (Obj* object = vm->young; object != NULL; object = object->next) {
+        if (object->type != OBJ_INSTANCE) continue;
+        ObjInstance* instance = (ObjInstance*)object;
+        FREE_ARRAY(vm, MEM_FIELDS, Value, instance->overflow,
+                   instance->overflowCapacity);
     }
+    vm->young = NULL;
+    countYoung(vm);
+    FREE_ARRAY(NULL, MEM_NONE, char, vm->nursery, NURSERY_SIZE);
+    FREE_ARRAY(NULL, MEM_NONE, Obj*, vm->remembered, vm->rememberedCapacity);
+    vm->nursery = NULL;
+    vm->nurseryTop = NULL;
+    vm->nurseryLimit = NULL;
+    vm->nurseryEnd = NULL;
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
 }
\ No newline at end of file
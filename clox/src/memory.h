@@ -7,28 +7,96 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 /*
  * Functions to help memory management in clox.
  *
- * reallocate(void* pointer, size_t oldSize, size_t newSize);
+ * reallocate(VM* vm, MemoryKind kind, void* pointer, size_t oldSize,
+ *            size_t newSize);
  * - if newSize is 0, we free memory
  * - otherwise we allocate newSize memory to existing pointer or to a new one.
+ * kind is what the memory is for, see heapstats.h.
  */
-#define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, kind, type, count) \
+    (type*)reallocate(vm, kind, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, kind, type, pointer) \
+    reallocate(vm, kind, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity * 2))
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)     \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, kind, type, pointer, oldCount, newCount)     \
+    (type*)reallocate(vm, kind, pointer, sizeof(type) * (oldCount), \
                       sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, kind, type, pointer, oldCount) \
+    reallocate(vm, kind, pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+// Heap size of the first collection.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+// One of the threads marking during a collection.
+typedef struct Marker Marker;
+// The state of an incremental collection between its steps.
+typedef struct Marking Marking;
+
+void* reallocate(VM* vm, MemoryKind kind, void* pointer, size_t oldSize,
+                 size_t newSize);
+void markObject(Marker* marker, Obj* object);
+void markValue(Marker* marker, Value value);
+void collectGarbage(VM* vm);
+void collectNow(VM* vm);
+void shadeObject(VM* vm, Obj* object);
+void finishSweep(VM* vm);
+void freeObjects(VM* vm);
+
+// The young generation, see memory.c.
+Obj* allocateYoung(VM* vm, size_t size);
+void releaseYoung(VM* vm, Obj* object);
+void rememberObject(VM* vm, Obj* object);
+void collectNursery(VM* vm);
+
+static inline bool isYoung(VM* vm, Obj* object) {
+    return (uintptr_t)object >= (uintptr_t)vm->nursery &&
+           (uintptr_t)object < (uintptr_t)vm->nurseryEnd;
+}
+
+/*
+ * The write barrier, for every store of a value into a field of an object.
+ *
+ * While an incremental collection is marking, the value is shaded, so that
+ * objects the collector is done with never come to point at objects it hasn't
+ * found. Old objects that come to point into the nursery are remembered,
+ * their fields are roots of the next minor collection.
+ */
+static inline void writeBarrier(VM* vm, Obj* object, Value value) {
+    if (!IS_OBJ(value)) return;
+    if (vm->marking != NULL) shadeObject(vm, AS_OBJ(value));
+    if (isYoung(vm, AS_OBJ(value)) && !object->isRemembered &&
+        !isYoung(vm, object)) {
+        rememberObject(vm, object);
+    }
+}
+
+// The same for stores of objects that are never young.
+static inline void markBarrier(VM* vm, Obj* object) {
+    if (vm->marking != NULL && object != NULL) shadeObject(vm, object);
+}
+
+// The same for stores into global variables, remembered all together.
+static inline void globalsBarrier(VM* vm, Value value) {
+    if (IS_OBJ(value) && isYoung(vm, AS_OBJ(value))) vm->youngGlobals = true;
+}
+
+/*
+ * Called where the interpreter holds on to no objects but through its roots,
+ * the only places a minor collection can move them. The sampler catches up
+ * here too.
+ */
+static inline void safePoint(VM* vm) {
+    if (vm->nurseryTop > vm->nurseryLimit) collectNursery(vm);
+    if (vm->sampler != NULL) drainSamples(vm);
+}
 
 #endif
\ No newline at end of file
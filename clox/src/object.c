@@ -17,38 +17,161 @@
  * allocateObject() calls clox's allocator reallocate() and performs something
  * similar to a malloc(size) and then returns a pointer pointing to this area.
  */
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);  // malloc(size)
-    object->type = type;                            // records the type
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    // malloc(size)
+    Obj* object = (Obj*)reallocate(vm, MEM_OBJECT(type), NULL, 0, size);
+    object->type = type;  // records the type
+    atomic_init(&object->isMarked, false);
+    object->isRemembered = false;
 
-    // Extend the global object list from the head -- the vm.objects list always
-    // points to the most recently created object.
-    object->next = vm.objects;
-    vm.objects = object;
+    // Extend the global object list from the head -- the vm->objects list
+    // always points to the most recently created object.
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
+// Sets up an object just bump allocated in the nursery.
+static Obj* initYoungObject(VM* vm, Obj* object, ObjType type) {
+    object->type = type;
+    atomic_init(&object->isMarked, false);
+    object->isRemembered = false;
+    object->next = vm->young;
+    vm->young = object;
+    vm->heapStats.kinds[MEM_NURSERY].count++;
+    return object;
+}
+
+/*
+ * Allocates an object that is likely to die young in the nursery, see
+ * memory.c, and in the old space if it doesn't fit.
+ *
+ * While collection is paused, objects are being built where the roots can't
+ * see them, so no young object may come to hang off them: those go to the
+ * old space as well.
+ */
+static Obj* allocateYoungObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = vm->gcPaused == 0 ? allocateYoung(vm, size) : NULL;
+    if (object == NULL) return allocateObject(vm, size, type);
+    return initYoungObject(vm, object, type);
+}
+
+/*
+ * Binds a method to the instance it was accessed on.
+ */
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, Value method) {
+    ObjBoundMethod* bound = (ObjBoundMethod*)allocateYoungObject(
+        vm, sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    writeBarrier(vm, (Obj*)bound, receiver);
+    writeBarrier(vm, (Obj*)bound, method);
+    return bound;
+}
+
+/*
+ * Creates the shape reached from parent by adding the field name. Without a
+ * parent, this is the empty shape at the root of a class' shape tree.
+ */
+static ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = 0;
+    initTable(&shape->fields);
+    initTable(&shape->transitions);
+
+    if (parent != NULL) {
+        tableAddAll(vm, &parent->fields, &shape->fields);
+        shape->fieldCount = parent->fieldCount + 1;
+        tableSet(vm, &shape->fields, name, INT_VAL(parent->fieldCount));
+    }
+    return shape;
+}
+
+/*
+ * Returns the shape for shape plus the field name, creating it the first time
+ * an instance takes that transition.
+ */
+static ObjShape* transitionShape(VM* vm, ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return (ObjShape*)AS_OBJ(next);
+    }
+
+    // The new shape isn't reachable until it is in the table.
+    vm->gcPaused++;
+    ObjShape* added = newShape(vm, shape, name);
+    tableSet(vm, &shape->transitions, name, OBJ_VAL(added));
+    vm->gcPaused--;
+    return added;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name) {
+    vm->gcPaused++;
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+    klass->name = name;
+    initTable(&klass->methods);
+    klass->shape = newShape(vm, NULL, NULL);
+    klass->inlineFields = INSTANCE_INLINE_MIN;
+    vm->gcPaused--;
+    return klass;
+}
+
+/*
+ * Creates a closure over function, with its captured values laid out inline.
+ * The vm fills the upvalues in as it executes OP_CLOSURE.
+ */
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        vm, sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount,
+        OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] = NIL_VAL;
+    }
+    return closure;
+}
+
+/*
+ * Creates a blank function, to be filled in by the compiler.
+ */
+ObjFunction* newFunction(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->upvalueCount = 0;
+    function->maxSlots = 0;
+    function->boxesLocals = false;
+    function->name = NULL;
+    initChunk(&function->chunk);
+    return function;
+}
+
 /*
  * Creates a string object in the heap.
  *
  * Creates a new ObjString in the heap and then initializes its fields.
  */
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(VM* vm, char* chars, int length,
+                                 uint32_t hash) {
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);  // Intern string to vm table.
+    vm->gcPaused++;
+    tableSet(vm, &vm->strings, string, NIL_VAL);  // Intern string to vm table.
+    vm->gcPaused--;
     return string;
 }
 
 /*
  * Implements the FNV-1a hashing algorithm.
  */
-static uint32_t hashString(const char* key, int length) {
+uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t)key[i];
@@ -57,40 +180,222 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+/*
+ * Looks for an interned string, first among the ones the VM shares with other
+ * VMs and then among its own.
+ */
+static ObjString* findString(VM* vm, const char* chars, int length,
+                             uint32_t hash) {
+    if (vm->shared != NULL) {
+        ObjString* shared =
+            tableFindString(&vm->shared->strings, chars, length, hash);
+        if (shared != NULL) return shared;
+    }
+    return tableFindString(&vm->strings, chars, length, hash);
+}
+
 /*
  * Claims ownership of the string chars given.
  */
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(VM* vm, char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, MEM_STRINGS, char, chars, length + 1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
+}
+
+/*
+ * Creates an instance with no fields, and room inline for as many fields as
+ * earlier instances of its class ended up with.
+ */
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    int inlineCount = klass->inlineFields;
+    ObjInstance* instance = (ObjInstance*)allocateYoungObject(
+        vm, sizeof(ObjInstance) + sizeof(Value) * inlineCount, OBJ_INSTANCE);
+    instance->klass = klass;
+    instance->shape = klass->shape;
+    instance->inlineCount = inlineCount;
+    instance->overflowCapacity = 0;
+    instance->overflow = NULL;
+    return instance;
+}
+
+/*
+ * Gives an instance a field it doesn't have yet.
+ */
+void addField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+    appendField(vm, instance, transitionShape(vm, instance->shape, name),
+                value);
+}
+
+/*
+ * Moves an instance to shape, a transition from its current shape, and stores
+ * the value of the field that adds. Inline caches use this directly once they
+ * know where the transition leads.
+ */
+void appendField(VM* vm, ObjInstance* instance, ObjShape* shape, Value value) {
+    int slot = shape->fieldCount - 1;
+
+    // Let later instances of the class fit this many fields inline.
+    ObjClass* klass = instance->klass;
+    if (shape->fieldCount > klass->inlineFields &&
+        shape->fieldCount <= INSTANCE_INLINE_MAX) {
+        klass->inlineFields = shape->fieldCount;
+    }
+
+    int overflowSlot = slot - instance->inlineCount;
+    if (overflowSlot >= instance->overflowCapacity) {
+        int oldCapacity = instance->overflowCapacity;
+        instance->overflowCapacity = GROW_CAPACITY(oldCapacity);
+        instance->overflow =
+            GROW_ARRAY(vm, MEM_FIELDS, Value, instance->overflow, oldCapacity,
+                       instance->overflowCapacity);
+    }
+
+    instance->shape = shape;
+    markBarrier(vm, (Obj*)shape);
+    *instanceField(instance, slot) = value;
+    writeBarrier(vm, (Obj*)instance, value);
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    return native;
+}
+
+ObjTask* newTask(VM* vm, Task* task) {
+    ObjTask* handle = ALLOCATE_OBJ(vm, ObjTask, OBJ_TASK);
+    handle->task = task;
+    return handle;
+}
+
+/*
+ * Creates an open upvalue for the local in the given stack slot.
+ */
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
+    upvalue->location = slot;
+    upvalue->closed = NIL_VAL;
+    return upvalue;
 }
 
 /*
  * Takes a C string and creates a new clox string object.
  */
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);    // create a new C string
-    memcpy(heapChars, chars, length);                // copy contents
-    heapChars[length] = '\0';                        // terminate
-    return allocateString(heapChars, length, hash);  // create the clox string
+    // create a new C string
+    char* heapChars = ALLOCATE(vm, MEM_STRINGS, char, length + 1);
+    memcpy(heapChars, chars, length);  // copy contents
+    heapChars[length] = '\0';          // terminate
+    // create the clox string
+    return allocateString(vm, heapChars, length, hash);
+}
+
+/*
+ * Creates the string a + b. In the nursery, it is built in place with its
+ * characters right after it, so that one that dies young costs no more than
+ * bumping the allocation pointer.
+ */
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b) {
+    int length = a->length + b->length;
+    ObjString* string =
+        vm->gcPaused == 0
+            ? (ObjString*)allocateYoung(vm, sizeof(ObjString) + length + 1)
+            : NULL;
+    char* chars = string != NULL ? (char*)(string + 1)
+                                 : ALLOCATE(vm, MEM_STRINGS, char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    if (string == NULL) return takeString(vm, chars, length);
+
+    uint32_t hash = hashString(chars, length);
+    ObjString* interned = findString(vm, chars, length, hash);
+    if (interned != NULL) {
+        releaseYoung(vm, (Obj*)string);
+        return interned;
+    }
+
+    initYoungObject(vm, (Obj*)string, OBJ_STRING);
+    string->length = length;
+    string->chars = chars;
+    string->hash = hash;
+    vm->gcPaused++;
+    tableSet(vm, &vm->strings, string, NIL_VAL);  // Intern string to vm table.
+    vm->gcPaused--;
+    return string;
+}
+
+// Writes a C string.
+static void writeChars(Output* output, const char* chars) {
+    writeOutput(output, chars, strlen(chars));
+}
+
+static void writeFunction(Output* output, ObjFunction* function) {
+    if (function->name == NULL) {
+        writeChars(output, "<script>");
+        return;
+    }
+    writeChars(output, "<fn ");
+    writeOutput(output, function->name->chars,
+                (size_t)function->name->length);
+    writeChars(output, ">");
 }
 
 /*
- * Prints a representation of an object based on its type
+ * Writes a representation of an object based on its type
  */
-void printObject(Value value) {
+void writeObject(Output* output, Value value) {
     switch (OBJ_TYPE(value)) {
+        case OBJ_BOUND_METHOD: {
+            Value method = AS_BOUND_METHOD(value)->method;
+            writeFunction(output, IS_CLOSURE(method)
+                                      ? AS_CLOSURE(method)->function
+                                      : AS_FUNCTION(method));
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjString* name = AS_CLASS(value)->name;
+            writeOutput(output, name->chars, (size_t)name->length);
+            break;
+        }
+        case OBJ_CLOSURE:
+            writeFunction(output, AS_CLOSURE(value)->function);
+            break;
+        case OBJ_FUNCTION:
+            writeFunction(output, AS_FUNCTION(value));
+            break;
+        case OBJ_INSTANCE: {
+            ObjString* name = AS_INSTANCE(value)->klass->name;
+            writeOutput(output, name->chars, (size_t)name->length);
+            writeChars(output, " instance");
+            break;
+        }
+        case OBJ_NATIVE:
+            writeChars(output, "<native fn>");
+            break;
+        case OBJ_SHAPE:
+            writeChars(output, "shape");  // Never visible to the user
+            break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(output, AS_CSTRING(value),
+                        (size_t)AS_STRING(value)->length);
+            break;
+        case OBJ_TASK:
+            writeChars(output, "<task>");
+            break;
+        case OBJ_UPVALUE:
+            writeChars(output, "upvalue");  // Never visible to the user
             break;
     }
 }
\ No newline at end of file
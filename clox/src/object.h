@@ -1,25 +1,196 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <stdatomic.h>
+
+#include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_TASK(value) isObjType(value, OBJ_TASK)
+#define IS_UPVALUE(value) isObjType(value, OBJ_UPVALUE)
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_TASK(value) ((ObjTask*)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 
 typedef enum {
+    OBJ_BOUND_METHOD,
+    OBJ_CLASS,
+    OBJ_CLOSURE,
+    OBJ_FUNCTION,
+    OBJ_INSTANCE,
+    OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
+    OBJ_TASK,
+    OBJ_UPVALUE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 struct Obj {
     ObjType type;
-    struct Obj* next;  // a linked list to point to the next object
+    atomic_bool isMarked;  // Reached by the current collection, see memory.c
+    bool isRemembered;     // Old, and known to point into the nursery
+    struct Obj* next;      // a linked list to point to the next object
 };
 
+/*
+ * A compiled Lox function. Each function owns the chunk holding its bytecode.
+ *
+ * The top level script is compiled into an implicit function too, which has
+ * no name.
+ */
+typedef struct {
+    Obj obj;
+    int arity;         // Number of parameters
+    int upvalueCount;  // Number of variables it captures
+    int maxSlots;      // Most stack slots a call can use, callee included
+    bool boxesLocals;  // Whether closures share any of its locals through
+                       // ObjUpvalues, which have to be closed on return
+    Chunk chunk;
+    ObjString* name;
+} ObjFunction;
+
+/*
+ * A function implemented in C.
+ *
+ * Natives read their arguments straight off the vm's stack: args points at the
+ * first one, and args[-1] is the slot the callee was in, which is where the
+ * result goes. A native returns false to raise a runtime error, with the
+ * message as a string in args[-1].
+ */
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+// Arity of natives that take any number of arguments.
+#define NATIVE_VARIADIC -1
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+    int arity;
+    ObjString* name;
+} ObjNative;
+
+/*
+ * A box for a captured local that can be assigned, shared by every closure
+ * that captures it.
+ *
+ * While the local is still on the stack the box is open, and location points
+ * at its stack slot. Once the local goes out of scope it is closed: the value
+ * moves into the box itself.
+ */
+typedef struct {
+    Obj obj;
+    Value* location;
+    Value closed;
+} ObjUpvalue;
+
+/*
+ * A function together with the variables it captured.
+ *
+ * Closures are flat: captured values live inline in the closure. Only
+ * variables that can be assigned after being captured need to be shared, and
+ * those slots hold an ObjUpvalue instead. Functions that capture nothing are
+ * never wrapped in a closure at all.
+ */
+typedef struct {
+    Obj obj;
+    ObjFunction* function;
+    int upvalueCount;
+    Value upvalues[];
+} ObjClosure;
+
+/*
+ * A hidden class: the layout of the fields of an instance.
+ *
+ * Instances that were given the same fields in the same order share a shape,
+ * and store their fields in the same slots. Giving an instance a new field
+ * moves it along a transition to the shape with that field added, so shapes
+ * form a tree rooted at the empty shape of each class. Shapes never change
+ * once created.
+ */
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;  // The shape this one was a transition from
+    ObjString* name;          // The field added by that transition
+    int fieldCount;
+    Table fields;       // Every field of the shape, mapped to its slot
+    Table transitions;  // Field name to the next shape
+} ObjShape;
+
+/*
+ * Inline slots given to the first instances of a class, before it has learned
+ * how many fields its instances end up with.
+ */
+#define INSTANCE_INLINE_MIN 4
+#define INSTANCE_INLINE_MAX UINT8_COUNT
+
+typedef struct {
+    Obj obj;
+    ObjString* name;
+    Table methods;
+    ObjShape* shape;   // Shape of new instances, with no fields
+    int inlineFields;  // Inline slots to give new instances
+} ObjClass;
+
+/*
+ * An instance of a class.
+ *
+ * Fields are stored in the slots given by the instance's shape. The first ones
+ * live inline, right after the instance, sized by the number of fields earlier
+ * instances of the class ended up with. Only fields beyond that spill over to
+ * a separate array.
+ */
+typedef struct {
+    Obj obj;
+    ObjClass* klass;
+    ObjShape* shape;
+    int inlineCount;
+    int overflowCapacity;
+    Value* overflow;
+    Value fields[];
+} ObjInstance;
+
+/*
+ * A method together with the instance it was accessed on.
+ */
+typedef struct {
+    Obj obj;
+    Value receiver;
+    Value method;  // An ObjClosure, or a bare ObjFunction
+} ObjBoundMethod;
+
+/*
+ * A handle to a task started with spawn(), see task.h. Every VM the handle has
+ * been passed to has its own, and the task lives on until all of them are
+ * freed.
+ */
+typedef struct Task Task;
+
+typedef struct {
+    Obj obj;
+    Task* task;
+} ObjTask;
+
 /*
  * A clox string object. Immutable.
  */
@@ -31,12 +202,41 @@ struct ObjString {
 };
 
 // Function declarations.
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-void printObject(Value value);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, Value method);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name);
+void addField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+void appendField(VM* vm, ObjInstance* instance, ObjShape* shape, Value value);
+uint32_t hashString(const char* key, int length);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b);
+ObjTask* newTask(VM* vm, Task* task);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+void writeObject(Output* output, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/*
+ * Returns the slot of a field in a shape, or -1 if the shape doesn't have it.
+ */
+static inline int findField(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->fields, name, &slot)) return -1;
+    return AS_INT(slot);
+}
+
+/*
+ * Returns where an instance stores the field in the given slot of its shape.
+ */
+static inline Value* instanceField(ObjInstance* instance, int slot) {
+    if (slot < instance->inlineCount) return &instance->fields[slot];
+    return &instance->overflow[slot - instance->inlineCount];
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "output.h"
+
+#include <string.h>
+
+#include "memory.h"
+
+/*
+ * Output starts out without a buffer, it only gets one once something is
+ * written. The buffer isn't part of any VM's heap.
+ */
+void initOutput(Output* output, OutputSink sink, void* context) {
+    output->chars = NULL;
+    output->count = 0;
+    output->capacity = 0;
+    output->lineStart = 0;
+    output->mode = OUTPUT_FULL;
+    output->sink = sink;
+    output->context = context;
+}
+
+// Flushes what is left first.
+void freeOutput(Output* output) {
+    flushOutput(output);
+    FREE_ARRAY(NULL, MEM_NONE, char, output->chars, output->capacity);
+    output->chars = NULL;
+    output->capacity = 0;
+}
+
+// Makes room for length more bytes, in the same line.
+static void reserveOutput(Output* output, size_t length) {
+    // The lines written so far go first, then the buffer grows if the line
+    // still doesn't fit.
+    if (output->lineStart > 0) {
+        output->sink(output->context, output->chars, output->lineStart);
+        output->count -= output->lineStart;
+        memmove(output->chars, output->chars + output->lineStart,
+                output->count);
+        output->lineStart = 0;
+    }
+    if (output->count + length <= output->capacity) return;
+
+    size_t capacity =
+        output->capacity < OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE
+                                              : output->capacity;
+    while (capacity < output->count + length) capacity *= 2;
+    output->chars = GROW_ARRAY(NULL, MEM_NONE, char, output->chars,
+                               output->capacity, capacity);
+    output->capacity = capacity;
+}
+
+void writeOutput(Output* output, const char* chars, size_t length) {
+    if (output->count + length > output->capacity) {
+        reserveOutput(output, length);
+    }
+    memcpy(output->chars + output->count, chars, length);
+    output->count += length;
+}
+
+void endLine(Output* output) {
+    writeOutput(output, "\n", 1);
+    output->lineStart = output->count;
+    if (output->mode == OUTPUT_LINE) flushOutput(output);
+}
+
+// Hands everything written over to the sink, the line being written included.
+void flushOutput(Output* output) {
+    if (output->count == 0) return;
+    output->sink(output->context, output->chars, output->count);
+    output->count = 0;
+    output->lineStart = 0;
+}
+
+void writeToFile(void* file, const char* chars, size_t length) {
+    fwrite(chars, sizeof(char), length, (FILE*)file);
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+/*
+ * Buffered output, for what print statements print.
+ *
+ * Printed values are gathered in a buffer and handed to a sink a block of
+ * lines at a time, instead of going through stdio, and its locking, piece by
+ * piece. Only whole lines are ever handed over, so that VMs printing to the
+ * same place, like a script and its tasks, don't cut into each other's lines.
+ * A line longer than the buffer grows it.
+ */
+
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE (16 * 1024)
+
+// Takes length bytes of output. A VM only ever hands over whole lines. The
+// tasks a VM spawns call its sink from their own threads, at the same time as
+// it and each other, so a sink must be thread-safe: writeToFile() is, since
+// stdio locks the FILE for each write.
+typedef void (*OutputSink)(void* context, const char* chars, size_t length);
+
+typedef enum {
+    OUTPUT_FULL,  // Flushed once the buffer is full, and when asked to
+    OUTPUT_LINE,  // Flushed after every line, for terminals
+} OutputMode;
+
+typedef struct {
+    char* chars;
+    size_t count;
+    size_t capacity;
+    size_t lineStart;  // Where the line being written starts
+    OutputMode mode;
+    OutputSink sink;
+    void* context;  // Passed on to the sink
+} Output;
+
+void initOutput(Output* output, OutputSink sink, void* context);
+void freeOutput(Output* output);
+void writeOutput(Output* output, const char* chars, size_t length);
+void endLine(Output* output);
+void flushOutput(Output* output);
+
+// A sink writing to the FILE* it is given as its context.
+void writeToFile(void* file, const char* chars, size_t length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,162 @@
+/*
+ * Counts and times the instructions the vm runs.
+ */
+
+// clock_gettime() is POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "memory.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS "cycles"
+#else
+#define TICKS "ns"
+#endif
+
+// How many of the most frequent pairs the report shows.
+#define PROFILE_PAIRS 20
+
+void initProfile(Profile* profile) {
+    memset(profile, 0, sizeof(Profile));
+    profile->previous = PROFILE_NONE;
+}
+
+/*
+ * All tasks add to the totals of the VM that isn't a task, however deeply
+ * they are nested. That VM is the only one that allocates them, there is no
+ * race.
+ */
+void inheritProfile(Profile* task, Profile* spawner) {
+    if (spawner->tasks == NULL) {
+        ProfileTotals* tasks = ALLOCATE(NULL, MEM_NONE, ProfileTotals, 1);
+        pthread_mutex_init(&tasks->lock, NULL);
+        tasks->profile = ALLOCATE(NULL, MEM_NONE, Profile, 1);
+        initProfile(tasks->profile);
+        spawner->tasks = tasks;
+    }
+    task->tasks = spawner->tasks;
+    task->isTask = true;
+}
+
+uint64_t readTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void endProfile(Profile* profile) {
+    if (profile->previous == PROFILE_NONE) return;
+    profile->ticks[profile->previous] += readTicks() - profile->lastTick;
+    profile->previous = PROFILE_NONE;
+}
+
+// An instruction or a pair of them, and what it is being ranked by.
+typedef struct {
+    int first;
+    int second;
+    uint64_t key;
+} Ranked;
+
+static int compareRanked(const void* a, const void* b) {
+    uint64_t x = ((const Ranked*)a)->key;
+    uint64_t y = ((const Ranked*)b)->key;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0.0 : 100.0 * (double)part / (double)whole;
+}
+
+static void addProfile(Profile* to, Profile* from) {
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        to->counts[i] += from->counts[i];
+        to->ticks[i] += from->ticks[i];
+        for (int j = 0; j < OPCODE_COUNT; j++) {
+            to->pairs[i][j] += from->pairs[i][j];
+        }
+    }
+}
+
+/*
+ * Ranks the instructions by the time spent in them, then lists the pairs that
+ * ran most often.
+ */
+static void printProfile(Profile* profile) {
+    uint64_t instructions = 0;
+    uint64_t ticks = 0;
+    Ranked ranked[OPCODE_COUNT];
+    int count = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        instructions += profile->counts[i];
+        ticks += profile->ticks[i];
+        if (profile->counts[i] > 0) {
+            ranked[count++] = (Ranked){i, 0, profile->ticks[i]};
+        }
+    }
+    if (instructions == 0) return;
+    qsort(ranked, count, sizeof(Ranked), compareRanked);
+
+    printf("== opcode profile: %llu instructions, %llu %s ==\n",
+           (unsigned long long)instructions, (unsigned long long)ticks, TICKS);
+    printf("%-20s %14s %7s %16s %7s %10s\n", "opcode", "count", "%", TICKS,
+           "%", "per op");
+    for (int i = 0; i < count; i++) {
+        int op = ranked[i].first;
+        printf("%-20s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n", opcodeName(op),
+               (unsigned long long)profile->counts[op],
+               percent(profile->counts[op], instructions),
+               (unsigned long long)profile->ticks[op],
+               percent(profile->ticks[op], ticks),
+               (double)profile->ticks[op] / (double)profile->counts[op]);
+    }
+
+    Ranked pairs[OPCODE_COUNT * OPCODE_COUNT];
+    count = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        for (int j = 0; j < OPCODE_COUNT; j++) {
+            if (profile->pairs[i][j] > 0) {
+                pairs[count++] = (Ranked){i, j, profile->pairs[i][j]};
+            }
+        }
+    }
+    qsort(pairs, count, sizeof(Ranked), compareRanked);
+
+    printf("== opcode pairs ==\n");
+    for (int i = 0; i < count && i < PROFILE_PAIRS; i++) {
+        printf("%-20s %-20s %14llu %6.2f%%\n", opcodeName(pairs[i].first),
+               opcodeName(pairs[i].second),
+               (unsigned long long)pairs[i].key,
+               percent(pairs[i].key, instructions));
+    }
+}
+
+void finishProfile(Profile* profile) {
+    if (profile->isTask) {
+        pthread_mutex_lock(&profile->tasks->lock);
+        addProfile(profile->tasks->profile, profile);
+        pthread_mutex_unlock(&profile->tasks->lock);
+        return;
+    }
+
+    if (profile->tasks != NULL) {
+        addProfile(profile, profile->tasks->profile);
+        pthread_mutex_destroy(&profile->tasks->lock);
+        FREE(NULL, MEM_NONE, Profile, profile->tasks->profile);
+        FREE(NULL, MEM_NONE, ProfileTotals, profile->tasks);
+        profile->tasks = NULL;
+    }
+    printProfile(profile);
+}
\ No newline at end of file
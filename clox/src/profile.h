@@ -0,0 +1,69 @@
+/*
+ * Opcode profiling, for builds with DEBUG_PROFILE_OPCODES.
+ *
+ * The vm counts every instruction it dispatches, and every pair of
+ * consecutive ones, and charges the time from one dispatch to the next to the
+ * instruction that was running. The pairs are the candidates for
+ * superinstructions, the time shows which instructions need a fast path.
+ * Reading the clock costs a few dozen cycles itself, charged to every
+ * instruction alike.
+ */
+
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <pthread.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Stands in for the previous instruction when there is none to charge.
+#define PROFILE_NONE OPCODE_COUNT
+
+typedef struct Profile Profile;
+
+// What the tasks of a VM, and their tasks in turn, ran between them.
+typedef struct {
+    pthread_mutex_t lock;
+    Profile* profile;
+} ProfileTotals;
+
+struct Profile {
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t ticks[OPCODE_COUNT];  // Time spent, see readTicks()
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+    int previous;  // The instruction running since lastTick
+    uint64_t lastTick;
+    ProfileTotals* tasks;  // Where tasks add their profiles, if any spawned
+    bool isTask;           // Whether this is a task's, added to tasks
+};
+
+void initProfile(Profile* profile);
+
+// Have a task's VM add its profile to its spawner's totals once it's freed
+void inheritProfile(Profile* task, Profile* spawner);
+
+// Reads the clock the profile keeps time with: the cycle counter where there
+// is one, nanoseconds otherwise.
+uint64_t readTicks(void);
+
+// Charge the instruction that was running, and start timing the next one
+static inline void profileInstruction(Profile* profile, uint8_t instruction) {
+    uint64_t now = readTicks();
+    if (profile->previous != PROFILE_NONE) {
+        profile->ticks[profile->previous] += now - profile->lastTick;
+        profile->pairs[profile->previous][instruction]++;
+    }
+    profile->counts[instruction]++;
+    profile->previous = instruction;
+    profile->lastTick = now;
+}
+
+// Charge the instruction that was running, the vm is leaving run()
+void endProfile(Profile* profile);
+
+// Called by freeVM(): a task's profile is added to its spawner's totals, any
+// other is printed along with the totals of its tasks.
+void finishProfile(Profile* profile);
+
+#endif
\ No newline at end of file
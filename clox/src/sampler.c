@@ -0,0 +1,304 @@
+/*
+ * Samples the call stack on a CPU timer and counts where it was.
+ */
+
+// sigaction() and setitimer() are POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include "sampler.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define SAMPLE_INTERVAL_US 1000
+#define SAMPLE_DEPTH 64     // Innermost frames kept, the rest are cut off
+#define SAMPLE_BUFFER 256   // Samples the VM may fall behind on draining
+#define COUNTS_MAX_LOAD 0.75
+
+typedef struct {
+    ObjFunction* function;
+    int offset;  // Of the instruction running in the function's chunk
+} SampleFrame;
+
+// A call stack as the signal handler found it, innermost frame first.
+typedef struct {
+    int depth;
+    bool truncated;  // Whether there were more frames than SAMPLE_DEPTH
+    SampleFrame frames[SAMPLE_DEPTH];
+} Sample;
+
+// How often each of a set of strings came up.
+typedef struct {
+    char* key;
+    uint64_t count;
+} Count;
+
+typedef struct {
+    int count;
+    int capacity;
+    Count* entries;
+} Counts;
+
+struct Sampler {
+    // The handler fills the slot at head, the VM drains the one at tail. Both
+    // run on the same thread, so signal fences are all the ordering needed.
+    Sample samples[SAMPLE_BUFFER];
+    volatile sig_atomic_t head;
+    volatile sig_atomic_t tail;
+    volatile sig_atomic_t dropped;  // Samples taken with the buffer full
+
+    uint64_t taken;
+    Counts lines;   // Innermost "function:line" of each sample
+    Counts stacks;  // Whole stacks, root first, separated by ';'
+    char* buffer;   // For building the keys
+    size_t bufferCapacity;
+    struct sigaction previous;
+};
+
+// The sampled VM, and whether the thread a signal lands on is running it.
+static VM* sampledVM = NULL;
+static _Thread_local bool onSampledThread = false;
+
+static uint32_t hashKey(const char* key) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = key; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static Count* findCount(Count* entries, int capacity, const char* key) {
+    uint32_t index = hashKey(key) & (capacity - 1);
+    for (;;) {
+        Count* entry = &entries[index];
+        if (entry->key == NULL || strcmp(entry->key, key) == 0) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void addCount(Counts* counts, const char* key) {
+    if (counts->count + 1 > counts->capacity * COUNTS_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(counts->capacity);
+        Count* entries = ALLOCATE(NULL, MEM_NONE, Count, capacity);
+        for (int i = 0; i < capacity; i++) entries[i].key = NULL;
+        for (int i = 0; i < counts->capacity; i++) {
+            Count* entry = &counts->entries[i];
+            if (entry->key == NULL) continue;
+            *findCount(entries, capacity, entry->key) = *entry;
+        }
+        FREE_ARRAY(NULL, MEM_NONE, Count, counts->entries, counts->capacity);
+        counts->entries = entries;
+        counts->capacity = capacity;
+    }
+
+    Count* entry = findCount(counts->entries, counts->capacity, key);
+    if (entry->key == NULL) {
+        size_t length = strlen(key) + 1;
+        entry->key = ALLOCATE(NULL, MEM_NONE, char, length);
+        memcpy(entry->key, key, length);
+        entry->count = 0;
+        counts->count++;
+    }
+    entry->count++;
+}
+
+static void freeCounts(Counts* counts) {
+    for (int i = 0; i < counts->capacity; i++) {
+        char* key = counts->entries[i].key;
+        if (key != NULL) FREE_ARRAY(NULL, MEM_NONE, char, key, strlen(key) + 1);
+    }
+    FREE_ARRAY(NULL, MEM_NONE, Count, counts->entries, counts->capacity);
+}
+
+/*
+ * The signal handler. It reads the VM wherever it was interrupted, so the VM
+ * only ever publishes frames that are complete, see call(), and takes nothing
+ * here but plain loads. The ip of the innermost frame is the one it stored at
+ * its last safe point, see TAKE_STEP() in vm.c.
+ */
+static void takeSample(int signal) {
+    (void)signal;
+    if (!onSampledThread) return;
+    VM* vm = sampledVM;
+    Sampler* sampler = vm->sampler;
+    int next = (sampler->head + 1) % SAMPLE_BUFFER;
+    if (next == sampler->tail) {
+        sampler->dropped++;
+        return;
+    }
+    // Compiling, or in between scripts.
+    int frameCount = vm->frameCount;
+    if (frameCount == 0) return;
+
+    Sample* sample = &sampler->samples[sampler->head];
+    CallFrame* frames = vm->frames;
+    int depth = 0;
+    for (int i = frameCount - 1; i >= 0 && depth < SAMPLE_DEPTH; i--) {
+        ObjFunction* function = frames[i].function;
+        // ip is past the instruction's opcode, or past a caller's call.
+        int offset = (int)(frames[i].ip - function->chunk.code) - 1;
+        sample->frames[depth].function = function;
+        sample->frames[depth].offset = offset < 0 ? 0 : offset;
+        depth++;
+    }
+    sample->depth = depth;
+    sample->truncated = depth < frameCount;
+
+    atomic_signal_fence(memory_order_release);
+    sampler->head = next;
+}
+
+static void freeSampler(VM* vm) {
+    Sampler* sampler = vm->sampler;
+    freeCounts(&sampler->lines);
+    freeCounts(&sampler->stacks);
+    FREE_ARRAY(NULL, MEM_NONE, char, sampler->buffer, sampler->bufferCapacity);
+    FREE(NULL, MEM_NONE, Sampler, sampler);
+    vm->sampler = NULL;
+    sampledVM = NULL;
+    onSampledThread = false;
+}
+
+bool startSampler(VM* vm) {
+    if (sampledVM != NULL) return false;
+
+    Sampler* sampler = ALLOCATE(NULL, MEM_NONE, Sampler, 1);
+    sampler->head = 0;
+    sampler->tail = 0;
+    sampler->dropped = 0;
+    sampler->taken = 0;
+    sampler->lines = (Counts){0, 0, NULL};
+    sampler->stacks = (Counts){0, 0, NULL};
+    sampler->buffer = NULL;
+    sampler->bufferCapacity = 0;
+    vm->sampler = sampler;
+    sampledVM = vm;
+    onSampledThread = true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    sigemptyset(&action.sa_mask);
+    // Don't make the VM's reads and waits fail with EINTR.
+    action.sa_flags = SA_RESTART;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    if (sigaction(SIGPROF, &action, &sampler->previous) != 0) {
+        freeSampler(vm);
+        return false;
+    }
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &sampler->previous, NULL);
+        freeSampler(vm);
+        return false;
+    }
+    return true;
+}
+
+// Appends to the key being built, growing the buffer as needed.
+static void appendKey(Sampler* sampler, size_t* length, const char* text) {
+    size_t added = strlen(text);
+    if (*length + added + 1 > sampler->bufferCapacity) {
+        size_t capacity = sampler->bufferCapacity;
+        while (*length + added + 1 > capacity) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        sampler->buffer = GROW_ARRAY(NULL, MEM_NONE, char, sampler->buffer,
+                                     sampler->bufferCapacity, capacity);
+        sampler->bufferCapacity = capacity;
+    }
+    memcpy(sampler->buffer + *length, text, added + 1);
+    *length += added;
+}
+
+static void frameName(SampleFrame* frame, char* name, size_t size) {
+    ObjFunction* function = frame->function;
+    snprintf(name, size, "%s:%d",
+             function->name != NULL ? function->name->chars : "script",
+             function->chunk.lines[frame->offset]);
+}
+
+static void countSample(Sampler* sampler, Sample* sample) {
+    char name[256];
+    sampler->taken++;
+    frameName(&sample->frames[0], name, sizeof(name));
+    addCount(&sampler->lines, name);
+
+    size_t length = 0;
+    appendKey(sampler, &length, sample->truncated ? "...;" : "");
+    for (int i = sample->depth - 1; i >= 0; i--) {
+        frameName(&sample->frames[i], name, sizeof(name));
+        appendKey(sampler, &length, name);
+        if (i > 0) appendKey(sampler, &length, ";");
+    }
+    addCount(&sampler->stacks, sampler->buffer);
+}
+
+void drainSamples(VM* vm) {
+    Sampler* sampler = vm->sampler;
+    while (sampler->tail != sampler->head) {
+        atomic_signal_fence(memory_order_acquire);
+        countSample(sampler, &sampler->samples[sampler->tail]);
+        sampler->tail = (sampler->tail + 1) % SAMPLE_BUFFER;
+    }
+}
+
+static int compareCounts(const void* a, const void* b) {
+    uint64_t x = (*(const Count* const*)a)->count;
+    uint64_t y = (*(const Count* const*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void printLines(VM* vm, Sampler* sampler) {
+    Counts* lines = &sampler->lines;
+    fprintf(vm->err, "== profile: %llu samples",
+            (unsigned long long)sampler->taken);
+    if (sampler->dropped > 0) {
+        fprintf(vm->err, ", %d dropped", (int)sampler->dropped);
+    }
+    fprintf(vm->err, " ==\n");
+    if (lines->count == 0) return;
+
+    Count** sorted = ALLOCATE(NULL, MEM_NONE, Count*, lines->count);
+    int count = 0;
+    for (int i = 0; i < lines->capacity; i++) {
+        if (lines->entries[i].key != NULL) sorted[count++] = &lines->entries[i];
+    }
+    qsort(sorted, count, sizeof(Count*), compareCounts);
+    for (int i = 0; i < count; i++) {
+        fprintf(vm->err, "%10llu %6.2f%%  %s\n",
+                (unsigned long long)sorted[i]->count,
+                100.0 * (double)sorted[i]->count / (double)sampler->taken,
+                sorted[i]->key);
+    }
+    FREE_ARRAY(NULL, MEM_NONE, Count*, sorted, lines->count);
+}
+
+void stopSampler(VM* vm, FILE* folded) {
+    Sampler* sampler = vm->sampler;
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &sampler->previous, NULL);
+
+    drainSamples(vm);
+    printLines(vm, sampler);
+    Counts* stacks = &sampler->stacks;
+    for (int i = 0; i < stacks->capacity; i++) {
+        Count* entry = &stacks->entries[i];
+        if (entry->key == NULL) continue;
+        fprintf(folded, "%s %llu\n", entry->key,
+                (unsigned long long)entry->count);
+    }
+    freeSampler(vm);
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+/*
+ * A sampling profiler, for finding the hot lines of a script without
+ * instrumenting it.
+ *
+ * A SIGPROF timer interrupts the VM every millisecond of CPU time. The signal
+ * handler copies the function and instruction offset of the innermost frames
+ * into a ring buffer, and the VM drains that at its safe points, mapping the
+ * offsets to lines through the chunks' line tables. What comes out is a
+ * histogram of the lines the samples landed on, and the call stacks they were
+ * taken in, folded the way flame graph tools expect.
+ *
+ * The VM only stores where it is for the handler to see at its safe points,
+ * calls and loop back edges, so a sample is only precise to the last of those
+ * that the innermost frame went through. Between them it may land on a line
+ * the VM has already left.
+ *
+ * Only the VM that started the sampler is sampled, not the tasks it spawns.
+ */
+
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+typedef struct Sampler Sampler;
+
+// Start sampling a VM that runs on this thread. One at a time per process.
+bool startSampler(VM* vm);
+
+// Map the samples taken so far to lines. A function that a sample saw on the
+// stack is only known to be alive until the next collection ends.
+void drainSamples(VM* vm);
+
+// Stop sampling, write the folded stacks to folded, and the hottest lines to
+// the VM's error output
+void stopSampler(VM* vm, FILE* folded);
+
+#endif
\ No newline at end of file
@@ -56,7 +56,16 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+/*
+ * Where the scanner is in the source. Each compilation has its own.
+ */
+typedef struct {
+    const char* start;    // Start of the token being scanned
+    const char* current;  // Character being looked at
+    int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "shared.h"
+
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+
+/*
+ * The heap belongs to no VM, so its memory is allocated with a NULL vm.
+ */
+void initSharedHeap(SharedHeap* heap) {
+    initTable(&heap->strings);
+    heap->objects = NULL;
+    heap->frozen = false;
+
+    // Every VM looks initializers up by this name.
+    internShared(heap, "init", 4);
+}
+
+void freeSharedHeap(SharedHeap* heap) {
+    Obj* object = heap->objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        ObjString* string = (ObjString*)object;
+        FREE_ARRAY(NULL, MEM_NONE, char, string->chars, string->length + 1);
+        FREE(NULL, MEM_NONE, ObjString, string);
+        object = next;
+    }
+    freeTable(NULL, &heap->strings);
+    heap->objects = NULL;
+    heap->frozen = false;
+}
+
+/*
+ * Returns the heap's string with the given chars, adding it unless the heap
+ * is already frozen, in which case NULL means it isn't there.
+ */
+ObjString* internShared(SharedHeap* heap, const char* chars, int length) {
+    uint32_t hash = hashString(chars, length);
+    ObjString* interned =
+        tableFindString(&heap->strings, chars, length, hash);
+    if (interned != NULL || heap->frozen) return interned;
+
+    ObjString* string = ALLOCATE(NULL, MEM_NONE, ObjString, 1);
+    string->obj.type = OBJ_STRING;
+    // Always marked, so that collectors of the VMs sharing the string never
+    // write to it, and never free it.
+    atomic_init(&string->obj.isMarked, true);
+    string->obj.isRemembered = false;
+    string->obj.next = heap->objects;
+    heap->objects = (Obj*)string;
+    string->length = length;
+    string->chars = ALLOCATE(NULL, MEM_NONE, char, length + 1);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    string->hash = hash;
+    tableSet(NULL, &heap->strings, string, NIL_VAL);
+    return string;
+}
+
+/*
+ * Interns the strings compiling source would create: the names of variables,
+ * properties and methods, and string literals.
+ *
+ * Only scanning is needed for that, errors are left for the compiler to
+ * report when the script actually runs.
+ */
+void internSource(SharedHeap* heap, const char* source) {
+    Scanner scanner;
+    initScanner(&scanner, source);
+    for (;;) {
+        Token token = scanToken(&scanner);
+        if (token.type == TOKEN_EOF) break;
+        if (token.type == TOKEN_IDENTIFIER) {
+            internShared(heap, token.start, token.length);
+        } else if (token.type == TOKEN_STRING) {
+            // Without the quotes, like the compiler.
+            internShared(heap, token.start + 1, token.length - 2);
+        }
+    }
+}
+
+/*
+ * Ends loading. From here on the heap is only read, and may be shared.
+ */
+void freezeSharedHeap(SharedHeap* heap) { heap->frozen = true; }
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef clox_shared_h
+#define clox_shared_h
+
+#include "common.h"
+#include "table.h"
+
+/*
+ * Strings interned once and then shared by any number of VMs, including VMs
+ * running on other threads.
+ *
+ * The heap is filled by a single thread, typically with every identifier and
+ * string literal of the scripts about to run, and then frozen. Nothing writes
+ * to it after that, so VMs look strings up in it without locking and only
+ * intern the strings it doesn't have in their own table. A VM never frees or
+ * collects the strings it finds here.
+ */
+typedef struct SharedHeap {
+    Table strings;
+    Obj* objects;  // Every string in the heap
+    bool frozen;
+} SharedHeap;
+
+void initSharedHeap(SharedHeap* heap);
+void freeSharedHeap(SharedHeap* heap);
+ObjString* internShared(SharedHeap* heap, const char* chars, int length);
+void internSource(SharedHeap* heap, const char* source);
+void freezeSharedHeap(SharedHeap* heap);
+
+#endif
\ No newline at end of file
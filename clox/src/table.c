@@ -15,8 +15,8 @@ void initTable(Table* table) {
     table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, MEM_TABLES, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -68,8 +68,8 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
 /*
  * Allocates an array of buckets.
  */
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = ALLOCATE(vm, MEM_TABLES, Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -78,7 +78,7 @@ static void adjustCapacity(Table* table, int capacity) {
     // If we are growing a existing table, we need to reinsert all the old
     // elements. Do a linear pass through the old table, reinsert all of the
     // previous elements first
-    table->capacity = 0;
+    table->count = 0;  // Tombstones aren't copied, so recount
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
@@ -89,7 +89,7 @@ static void adjustCapacity(Table* table, int capacity) {
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, MEM_TABLES, Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
 }
@@ -100,11 +100,11 @@ static void adjustCapacity(Table* table, int capacity) {
  * If entry is already present, overwrite with new value.
  * Else create new hash table entry, update count for load factor.
  */
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
     // Grow table if we exceed ideal load factor
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
@@ -134,11 +134,11 @@ bool tableDelete(Table* table, ObjString* key) {
     return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -163,6 +163,41 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
             return entry->key;
         }
 
+        index = (index + 1) % table->capacity;
+    }
+}
+
+/*
+ * Drops the keys the collector didn't mark. The intern table must not keep
+ * strings alive by itself.
+ */
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL &&
+            !atomic_load_explicit(&entry->key->obj.isMarked,
+                                  memory_order_relaxed)) {
+            tableDelete(table, entry->key);
+        }
+    }
+}
+
+/*
+ * Replaces a key with a copy of the same string, made when the string was
+ * moved out of the nursery.
+ */
+void tableMoveKey(Table* table, ObjString* from, ObjString* to) {
+    if (table->count == 0) return;
+
+    uint32_t index = to->hash % table->capacity;
+    for (;;) {
+        Entry* entry = &table->entries[index];
+        if (entry->key == from) {
+            entry->key = to;
+            return;
+        }
+        if (entry->key == NULL && IS_NIL(entry->value)) return;  // Not there
+
         index = (index + 1) % table->capacity;
     }
 }
\ No newline at end of file
@@ -18,12 +18,14 @@ typedef struct {
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
-bool tableSet(Table* table, ObjString* key, Value value);
-void tableAddAll(Table* from, Table* to);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash);
+void tableRemoveWhite(Table* table);
+void tableMoveKey(Table* table, ObjString* from, ObjString* to);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,450 @@
+// sysconf() is POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include "task.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+struct Task {
+    VM vm;
+    VM* spawner;  // Counts the task as pending until it has ended
+    Scheduler* scheduler;
+    int argCount;  // Arguments on the VM's stack, after the function
+    bool failed;   // Whether the call ended in a runtime error
+    Value result;  // Otherwise what it returned, in the task's heap
+    atomic_bool claimed;  // Taken to run, by a worker or by a joiner
+    atomic_bool done;
+    // Handles to the task in any VM, one for its place in a queue, and one
+    // until it has ended.
+    atomic_int refs;
+};
+
+/*
+ * A double-ended queue of tasks, as a ring buffer. Its worker pushes and pops
+ * at the tail, thieves take from the head.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int count;
+    int capacity;
+    Task** tasks;
+} TaskQueue;
+
+typedef struct {
+    Scheduler* scheduler;
+    int index;
+    pthread_t thread;
+} Worker;
+
+struct Scheduler {
+    VM* owner;  // The VM that started the pool, and stops it
+    int workerCount;
+    Worker* workers;
+    // One queue per worker, and a last one for threads outside the pool.
+    TaskQueue* queues;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // A task was queued, or one finished
+    int queued;              // Tasks waiting in any of the queues
+    bool stopping;
+};
+
+static void initQueue(TaskQueue* queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->head = 0;
+    queue->count = 0;
+    queue->capacity = 0;
+    queue->tasks = NULL;
+}
+
+static void freeQueue(TaskQueue* queue) {
+    FREE_ARRAY(NULL, MEM_NONE, Task*, queue->tasks, queue->capacity);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+static void pushTask(TaskQueue* queue, Task* task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        // Unwrap the ring into the new buffer.
+        int capacity = GROW_CAPACITY(queue->capacity);
+        Task** tasks = ALLOCATE(NULL, MEM_NONE, Task*, capacity);
+        for (int i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        FREE_ARRAY(NULL, MEM_NONE, Task*, queue->tasks, queue->capacity);
+        queue->tasks = tasks;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the newest task, the one most likely to still be in the cache.
+static Task* popTask(TaskQueue* queue) {
+    Task* task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Take the oldest task, which tends to stand for the most work.
+static Task* stealTask(TaskQueue* queue) {
+    Task* task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        task = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// The queue a thread works from, NO_WORKER for threads outside the pool.
+static int queueIndex(Scheduler* scheduler, int worker) {
+    return worker == NO_WORKER ? scheduler->workerCount : worker;
+}
+
+// Claims a task to run, unless another thread got to it first.
+static bool claimTask(Task* task) {
+    bool unclaimed = false;
+    return atomic_compare_exchange_strong(&task->claimed, &unclaimed, true);
+}
+
+/*
+ * Finds a task for the given worker to run: its own newest, or else the oldest
+ * of some other queue, starting with the next one along so that thieves spread
+ * out. Tasks that a joiner ran already are dropped from the queues here.
+ */
+static Task* takeTask(Scheduler* scheduler, int worker) {
+    int queues = scheduler->workerCount + 1;
+    int own = queueIndex(scheduler, worker);
+    for (;;) {
+        Task* task = popTask(&scheduler->queues[own]);
+        for (int i = 1; task == NULL && i < queues; i++) {
+            task = stealTask(&scheduler->queues[(own + i) % queues]);
+        }
+        if (task == NULL) return NULL;
+
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->queued--;
+        pthread_mutex_unlock(&scheduler->lock);
+        // The reference for the task's place in the queue. Until it has
+        // ended, it holds another one.
+        bool claimed = claimTask(task);
+        releaseTask(task);
+        if (claimed) return task;
+    }
+}
+
+/*
+ * Counts something a VM was waiting for as ended: one of the tasks it spawned,
+ * or in a task's VM, the task's own call. A task has ended once its call and
+ * all the tasks it spawned have, since they print to the same streams, and
+ * that is one thing less for its spawner to wait for in turn. Nothing here
+ * waits, so a task never holds up the thread that ran it.
+ */
+static void endPending(Scheduler* scheduler, VM* vm) {
+    while (vm != NULL) {
+        // Read before it is told: a VM outside any task may go right after.
+        Task* task = vm->task;
+        pthread_mutex_lock(&scheduler->lock);
+        bool last = atomic_fetch_sub(&vm->tasksPending, 1) == 1;
+        pthread_cond_broadcast(&scheduler->changed);
+        pthread_mutex_unlock(&scheduler->lock);
+        if (!last || task == NULL) return;
+
+        vm = task->spawner;
+        releaseTask(task);
+    }
+}
+
+/*
+ * Runs a task. Its result can be joined as soon as the call returns, but the
+ * task only ends once the tasks it spawned have too.
+ */
+static void runTask(Task* task, int worker) {
+    Scheduler* scheduler = task->scheduler;
+    VM* vm = &task->vm;
+    vm->worker = worker;
+    if (callFunction(vm, task->argCount) == INTERPRET_OK) {
+        task->result = vm->stackTop[-1];  // Left there, rooted
+    } else {
+        task->failed = true;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_store(&task->done, true);
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    endPending(scheduler, vm);
+}
+
+/*
+ * Waits for a task to finish. A task that is still queued is run right here;
+ * one that is running already is waited for without running anything else.
+ * Running some other task on top of this thread's stack could have it join a
+ * task suspended further down, which can't go on until it returns.
+ */
+static void waitForTask(Task* task, int worker) {
+    Scheduler* scheduler = task->scheduler;
+    if (claimTask(task)) {
+        runTask(task, worker);
+        return;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (!atomic_load(&task->done)) {
+        pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ * Only VMs outside any task wait for their tasks here, in freeVM(): a task's
+ * VM is freed once its tasks have ended. Nothing of the pool is suspended on
+ * such a thread's stack, so it is safe to run whatever is queued meanwhile.
+ */
+void waitForTasks(VM* vm) {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+    while (atomic_load(&vm->tasksPending) > 0) {
+        Task* task = takeTask(scheduler, vm->worker);
+        if (task != NULL) {
+            runTask(task, vm->worker);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        while (atomic_load(&vm->tasksPending) > 0 && scheduler->queued == 0) {
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+static void* runWorker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    Scheduler* scheduler = worker->scheduler;
+    for (;;) {
+        Task* task = takeTask(scheduler, worker->index);
+        if (task != NULL) {
+            runTask(task, worker->index);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        while (scheduler->queued == 0 && !scheduler->stopping) {
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+        }
+        bool stop = scheduler->queued == 0 && scheduler->stopping;
+        pthread_mutex_unlock(&scheduler->lock);
+        if (stop) return NULL;
+    }
+}
+
+/*
+ * Starts a pool with a worker for every core, for the VM that spawns the first
+ * task, or for the host when owner is NULL. The VMs of its tasks, and of their
+ * tasks, all share it.
+ */
+static Scheduler* startScheduler(VM* owner) {
+    Scheduler* scheduler = ALLOCATE(NULL, MEM_NONE, Scheduler, 1);
+    scheduler->owner = owner;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    scheduler->workerCount = cores > 0 ? (int)cores : 1;
+    scheduler->queues =
+        ALLOCATE(NULL, MEM_NONE, TaskQueue, scheduler->workerCount + 1);
+    for (int i = 0; i <= scheduler->workerCount; i++) {
+        initQueue(&scheduler->queues[i]);
+    }
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    scheduler->queued = 0;
+    scheduler->stopping = false;
+
+    scheduler->workers =
+        ALLOCATE(NULL, MEM_NONE, Worker, scheduler->workerCount);
+    for (int i = 0; i < scheduler->workerCount; i++) {
+        Worker* worker = &scheduler->workers[i];
+        worker->scheduler = scheduler;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+            // Fewer workers is fine, the threads that join help out anyway.
+            // The queue for threads outside the pool moves down to index i.
+            for (int j = i + 1; j <= scheduler->workerCount; j++) {
+                freeQueue(&scheduler->queues[j]);
+            }
+            scheduler->workerCount = i;
+            break;
+        }
+    }
+    return scheduler;
+}
+
+Scheduler* newScheduler(void) { return startScheduler(NULL); }
+
+void stopScheduler(Scheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (int i = 0; i < scheduler->workerCount; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+
+    int queues = scheduler->workerCount + 1;
+    for (int i = 0; i < queues; i++) freeQueue(&scheduler->queues[i]);
+    FREE_ARRAY(NULL, MEM_NONE, TaskQueue, scheduler->queues, queues);
+    FREE_ARRAY(NULL, MEM_NONE, Worker, scheduler->workers,
+               scheduler->workerCount);
+    pthread_cond_destroy(&scheduler->changed);
+    pthread_mutex_destroy(&scheduler->lock);
+    FREE(NULL, MEM_NONE, Scheduler, scheduler);
+}
+
+void freeScheduler(VM* vm) {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL || scheduler->owner != vm) return;
+    stopScheduler(scheduler);
+    vm->scheduler = NULL;
+}
+
+Task* retainTask(Task* task) {
+    atomic_fetch_add(&task->refs, 1);
+    return task;
+}
+
+void releaseTask(Task* task) {
+    if (atomic_fetch_sub(&task->refs, 1) != 1) return;
+
+    // The last reference goes once the task has ended, and its own tasks with
+    // it, so freeing the VM doesn't wait on anything.
+    freeVM(&task->vm);
+    FREE(NULL, MEM_NONE, Task, task);
+}
+
+static bool taskError(VM* vm, Value* args, const char* message) {
+    args[-1] = OBJ_VAL(copyString(vm, message, (int)strlen(message)));
+    return false;
+}
+
+/*
+ * spawn(fn, args...) calls fn with the arguments in a new task, and returns a
+ * handle to it right away.
+ */
+bool spawnNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1) return taskError(vm, args, "Expected a function.");
+    Value callee = args[0];
+    if (!IS_CLOSURE(callee) && !IS_FUNCTION(callee) &&
+        !IS_BOUND_METHOD(callee) && !IS_CLASS(callee) && !IS_NATIVE(callee)) {
+        return taskError(vm, args, "Can only spawn functions and classes.");
+    }
+
+    if (vm->scheduler == NULL) vm->scheduler = startScheduler(vm);
+
+    Task* task = ALLOCATE(NULL, MEM_NONE, Task, 1);
+    task->spawner = vm;
+    task->scheduler = vm->scheduler;
+    task->argCount = argCount - 1;
+    task->failed = false;
+    task->result = NIL_VAL;
+    atomic_init(&task->done, false);
+    atomic_init(&task->claimed, false);
+    atomic_init(&task->refs, 3);
+
+    VM* taskVM = &task->vm;
+    initSharedVM(taskVM, vm->shared);
+    // Nothing copied is reachable from the task's roots until it is all done.
+    taskVM->gcPaused++;
+    taskVM->scheduler = vm->scheduler;
+    taskVM->task = task;
+    atomic_store(&taskVM->tasksPending, 1);  // Its own call
+    taskVM->gcPauseUs = vm->gcPauseUs;
+    taskVM->heapLimit = vm->heapLimit;
+    taskVM->stepLimit = vm->stepLimit;
+    taskVM->timeLimitUs = vm->timeLimitUs;
+#ifdef DEBUG_PROFILE_OPCODES
+    inheritProfile(&taskVM->profile, &vm->profile);
+#endif
+    taskVM->out = vm->out;
+    taskVM->err = vm->err;
+    taskVM->output.mode = vm->output.mode;
+    if (vm->output.sink != printToOut) {
+        // The host's sink takes what the tasks print as well.
+        taskVM->output.sink = vm->output.sink;
+        taskVM->output.context = vm->output.context;
+    }
+
+    // Only the globals the task's code can name come along, so that a spawn
+    // costs what the task can reach rather than the whole heap. They share one
+    // map with the function and its arguments, which then refer to the same
+    // copies of anything they share with them.
+    CopyMap copies;
+    initCopyMap(&copies);
+    copies.globals = &vm->globals;
+    reserveStack(taskVM, argCount);
+    for (int i = 0; i < argCount; i++) {
+        push(taskVM, copyValue(taskVM, &copies, args[i]));
+    }
+    copyGlobals(taskVM, &copies);
+    freeCopyMap(taskVM, &copies);
+    taskVM->gcPaused--;
+
+    // What was printed before the spawn comes before what the task prints.
+    flushOutput(&vm->output);
+
+    // The handle goes in place before the task can run, and possibly finish.
+    args[-1] = OBJ_VAL(newTask(vm, task));
+
+    Scheduler* scheduler = vm->scheduler;
+    atomic_fetch_add(&vm->tasksPending, 1);
+    pushTask(&scheduler->queues[queueIndex(scheduler, vm->worker)], task);
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->queued++;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+/*
+ * join(task) waits for a task and returns a copy of its result. A task that
+ * ended in a runtime error has reported it already, joining it is an error as
+ * well.
+ */
+bool joinNative(VM* vm, int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_TASK(args[0])) return taskError(vm, args, "Expected a task.");
+    Task* task = AS_TASK(args[0])->task;
+
+    waitForTask(task, vm->worker);
+    if (task->failed) return taskError(vm, args, "Joined task failed.");
+
+    // The copies are old objects, and mustn't pick up young strings that
+    // happen to be interned here already. Natives run at a safe point.
+    collectNursery(vm);
+    CopyMap copies;
+    initCopyMap(&copies);
+    vm->gcPaused++;
+    args[-1] = copyValue(vm, &copies, task->result);
+    vm->gcPaused--;
+    freeCopyMap(vm, &copies);
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+/*
+ * Tasks: Lox functions running in parallel, on a work-stealing thread pool.
+ *
+ * spawn(fn, args...) starts a call to fn in a task and returns a handle to it,
+ * and join(task) waits for the call to return and gives its result. Every task
+ * runs in a VM of its own. Nothing is shared between VMs: the function, its
+ * arguments and the globals their code names are deep copied into the task's
+ * VM when it is spawned, as they are at that point, and the result is copied
+ * back out when it is joined. A VM waits for the tasks it spawned when it is
+ * freed.
+ *
+ * Each worker thread keeps a queue of tasks. A worker runs the newest task in
+ * its own queue first, and when that is empty steals the oldest task from
+ * another queue. A thread that joins a task that is still queued runs it
+ * itself, and otherwise waits for it without running anything else.
+ */
+
+#ifndef clox_task_h
+#define clox_task_h
+
+#include "common.h"
+#include "value.h"
+
+typedef struct Task Task;
+typedef struct Scheduler Scheduler;
+
+// Worker index of threads that aren't part of the pool.
+#define NO_WORKER -1
+
+bool spawnNative(VM* vm, int argCount, Value* args);
+bool joinNative(VM* vm, int argCount, Value* args);
+
+// Take another reference to a task, for a new handle
+Task* retainTask(Task* task);
+
+// Drop a reference to a task. The pool holds one until the task has ended, so
+// this never waits, and is safe in the middle of a collection.
+void releaseTask(Task* task);
+
+// Wait for the tasks a VM spawned, and the tasks they spawned, to end
+void waitForTasks(VM* vm);
+
+// Start a pool for the host to share between VMs, by setting their scheduler
+// before they run anything. It must outlive them, and be stopped after.
+Scheduler* newScheduler(void);
+void stopScheduler(Scheduler* scheduler);
+
+// Wait for the tasks of the pool a VM started and stop its threads
+void freeScheduler(VM* vm);
+
+#endif
\ No newline at end of file
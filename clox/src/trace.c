@@ -0,0 +1,135 @@
+/*
+ * Records traces through hot loops and specializes their bytecode.
+ */
+
+#include "trace.h"
+
+void startTrace(Trace* trace, Chunk* chunk, int loop) {
+    trace->recording = true;
+    trace->chunk = chunk;
+    trace->loop = loop;
+    trace->count = 0;
+}
+
+void abortTrace(Trace* trace) {
+    trace->recording = false;
+    trace->chunk = NULL;
+    trace->count = 0;
+}
+
+// What a binary instruction's operands were.
+static TraceKind binaryKind(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) return TRACE_INT;
+    if (IS_DOUBLE(a) && IS_DOUBLE(b)) return TRACE_DOUBLE;
+    return TRACE_GENERIC;
+}
+
+/*
+ * Records the operand types of a generic instruction we know how to
+ * specialize. The vm calls this just before the instruction runs.
+ *
+ * The trace follows whatever path execution takes until it comes back around
+ * to the loop's back edge. A path that leaves the loop and never returns fills
+ * the trace up or runs into the end of the script, and is thrown away.
+ */
+void recordInstruction(Trace* trace, uint8_t* ip, Value* stackTop) {
+    TraceKind kind;
+    switch (*ip) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_LESS:
+            kind = binaryKind(stackTop[-2], stackTop[-1]);
+            break;
+        case OP_NEGATE:
+            kind = binaryKind(stackTop[-1], stackTop[-1]);
+            break;
+        default:
+            return;  // Nothing to specialize.
+    }
+
+    if (trace->count == TRACE_MAX) {
+        abortTrace(trace);
+        return;
+    }
+
+    TraceEntry* entry = &trace->entries[trace->count++];
+    entry->ip = ip;
+    entry->kind = kind;
+}
+
+// The form of a generic instruction for operands of the given kind.
+static uint8_t specializedOpCode(uint8_t instruction, TraceKind kind) {
+    if (kind == TRACE_GENERIC) return instruction;
+    bool ints = kind == TRACE_INT;
+    switch (instruction) {
+        case OP_ADD:
+            return ints ? OP_ADD_INT : OP_ADD_DOUBLE;
+        case OP_SUBTRACT:
+            return ints ? OP_SUBTRACT_INT : OP_SUBTRACT_DOUBLE;
+        case OP_MULTIPLY:
+            return ints ? OP_MULTIPLY_INT : OP_MULTIPLY_DOUBLE;
+        case OP_DIVIDE:
+            return ints ? OP_DIVIDE_INT : OP_DIVIDE_DOUBLE;
+        case OP_GREATER:
+            return ints ? OP_GREATER_INT : OP_GREATER_DOUBLE;
+        case OP_LESS:
+            return ints ? OP_LESS_INT : OP_LESS_DOUBLE;
+        case OP_NEGATE:
+            return ints ? OP_NEGATE_INT : OP_NEGATE_DOUBLE;
+        default:
+            return instruction;
+    }
+}
+
+uint8_t genericOpCode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD_INT:
+        case OP_ADD_DOUBLE:
+            return OP_ADD;
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_DOUBLE:
+            return OP_SUBTRACT;
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_DOUBLE:
+            return OP_MULTIPLY;
+        case OP_DIVIDE_INT:
+        case OP_DIVIDE_DOUBLE:
+            return OP_DIVIDE;
+        case OP_GREATER_INT:
+        case OP_GREATER_DOUBLE:
+            return OP_GREATER;
+        case OP_LESS_INT:
+        case OP_LESS_DOUBLE:
+            return OP_LESS;
+        case OP_NEGATE_INT:
+        case OP_NEGATE_DOUBLE:
+            return OP_NEGATE;
+        default:
+            return instruction;
+    }
+}
+
+/*
+ * An instruction is only specialized if every time it ran during the trace its
+ * operands were of the same kind. Nested loops and calls can visit the same
+ * instruction more than once: the first pass leaves it in the form the last
+ * visit asked for, and the second puts it back to generic if any visit
+ * disagrees with that.
+ */
+void commitTrace(Trace* trace) {
+    for (int i = 0; i < trace->count; i++) {
+        TraceEntry* entry = &trace->entries[i];
+        *entry->ip = specializedOpCode(genericOpCode(*entry->ip), entry->kind);
+    }
+    for (int i = 0; i < trace->count; i++) {
+        TraceEntry* entry = &trace->entries[i];
+        uint8_t generic = genericOpCode(*entry->ip);
+        if (*entry->ip != specializedOpCode(generic, entry->kind)) {
+            *entry->ip = generic;
+        }
+    }
+    abortTrace(trace);
+}
\ No newline at end of file
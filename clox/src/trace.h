@@ -0,0 +1,63 @@
+/*
+ * Hot loop detection and trace-driven specialization.
+ *
+ * Every OP_LOOP bumps its loop's execution counter. Once a loop crosses
+ * HOT_LOOP_THRESHOLD, the vm records one iteration of it: which arithmetic and
+ * comparison instructions ran, and whether their operands were all integers or
+ * all doubles. When the iteration reaches the back edge again the trace is
+ * committed by rewriting those instructions into their *_INT or *_DOUBLE
+ * forms. These check each operand's tag once and go straight to the integer or
+ * floating point arithmetic, working on the stack in place. If the loop ever
+ * sees other types the check fails, and the instruction goes back to its
+ * generic form for good.
+ *
+ * Nothing is compiled: a trace only picks which instructions to rewrite.
+ */
+
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+#define HOT_LOOP_THRESHOLD 64
+#define TRACE_MAX 256
+
+// A specializable instruction seen while recording. Calls made from the loop
+// are traced through, so it may belong to any function's chunk.
+typedef enum {
+    TRACE_GENERIC,  // Anything else, left generic
+    TRACE_INT,      // Integer operands only
+    TRACE_DOUBLE,   // Double operands only
+} TraceKind;
+
+typedef struct {
+    uint8_t* ip;     // The instruction's opcode byte
+    TraceKind kind;  // What its operands were
+} TraceEntry;
+
+typedef struct {
+    bool recording;
+    Chunk* chunk;  // Chunk holding the loop being recorded
+    int loop;      // Counter index of the loop being recorded
+    int count;
+    TraceEntry entries[TRACE_MAX];
+} Trace;
+
+// Begin recording the body of a loop that just became hot
+void startTrace(Trace* trace, Chunk* chunk, int loop);
+
+// Observe the generic instruction at ip, which is about to run
+void recordInstruction(Trace* trace, uint8_t* ip, Value* stackTop);
+
+// Rewrite the recorded instructions into their specialized forms
+void commitTrace(Trace* trace);
+
+// Stop recording without touching the chunk
+void abortTrace(Trace* trace);
+
+// Map a specialized instruction back to the generic one it replaced
+uint8_t genericOpCode(uint8_t instruction);
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "dtoa.h"
 #include "memory.h"
 #include "object.h"
 
@@ -18,41 +19,66 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values =
-            GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, MEM_CONSTANTS, Value, array->values,
+                                   oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, MEM_CONSTANTS, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
-void printValue(Value value) {
+void writeValue(Output* output, Value value) {
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) {
+                writeOutput(output, "true", 4);
+            } else {
+                writeOutput(output, "false", 5);
+            }
             break;
         case VAL_NIL:
-            printf("nil");
+            writeOutput(output, "nil", 3);
             break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+        case VAL_NUMBER: {
+            char chars[NUMBER_CHARS_MAX];
+            int length = formatNumber(AS_NUMBER(value), chars);
+            writeOutput(output, chars, (size_t)length);
+            break;
+        }
+        case VAL_INT: {
+            char chars[NUMBER_CHARS_MAX];
+            int length = formatInteger(AS_INT(value), chars);
+            writeOutput(output, chars, (size_t)length);
             break;
+        }
         case VAL_OBJ:
-            printObject(value);
+            writeObject(output, value);
             break;
     }
 }
 
+// Prints straight to a stream, for debugging.
+void printValue(FILE* out, Value value) {
+    Output output;
+    initOutput(&output, writeToFile, out);
+    writeValue(&output, value);
+    freeOutput(&output);
+}
+
 bool valuesEqual(Value a, Value b) {
-    if (a.type != b.type) return false;
+    if (a.type != b.type) {
+        // An integer and a double can still hold the same number.
+        if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+        return false;
+    }
     switch (a.type) {
         case VAL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
@@ -60,6 +86,8 @@ bool valuesEqual(Value a, Value b) {
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:
+            return AS_INT(a) == AS_INT(b);
         case VAL_OBJ:
             return AS_OBJ(a) == AS_OBJ(b);
         default:
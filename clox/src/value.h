@@ -1,7 +1,10 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -15,6 +18,7 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,  // A number that happens to be a small integer
     VAL_OBJ,
 } ValueType;
 
@@ -32,6 +36,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int32_t integer;
         Obj* obj;
     } as;
 } Value;
@@ -43,13 +48,14 @@ typedef struct {
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 /*
  * Unpacks a Value to get the the C value back
  */
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
 #define AS_OBJ(value) ((value).as.obj)
 
 /*
@@ -57,9 +63,23 @@ typedef struct {
  */
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+/*
+ * Lox only has one number type. Internally a number is stored as a VAL_INT when
+ * it is a small integer, so that counting loops can use integer arithmetic, and
+ * as a double otherwise. The two are interchangeable everywhere the user can
+ * see.
+ */
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define AS_NUMBER(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : (value).as.number)
+
+// For code that knows which of the two it has, like specialized instructions.
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+#define AS_DOUBLE(value) ((value).as.number)
+
 // Constant Pool, an (dynamic) array of values
 typedef struct {
     int capacity;
@@ -69,8 +89,9 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
-void printValue(Value value);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
+void writeValue(Output* output, Value value);
+void printValue(FILE* out, Value value);
 
 #endif
\ No newline at end of file
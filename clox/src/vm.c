@@ -1,8 +1,13 @@
+// flockfile() is POSIX, not C11.
+#define _POSIX_C_SOURCE 200809L
+
 #include "vm.h"
 
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
@@ -10,104 +15,736 @@
 #include "memory.h"
 #include "object.h"
 
-VM vm;
+static bool clockNative(VM* vm, int argCount, Value* args) {
+    (void)vm;
+    (void)argCount;
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
 
 /*
  * Helper functions to manage the vm's value stack
  */
-static void resetStack() { vm.stackTop = vm.stack; }
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+}
+
+static void closeUpvalues(VM* vm, Value* last);
+
+// Frames shown at each end of the stack trace of a runtime error.
+#define TRACE_FRAMES 16
+
+static void runtimeError(VM* vm, const char* format, ...) {
+    flushOutput(&vm->output);  // What was printed before it went wrong
+    flockfile(vm->err);
 
-static void runtimeError(const char* format, ...) {
     // Variadic printing
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
+
+    // Print a stack trace, innermost call first. Deep recursion is cut down to
+    // the frames at either end.
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        if (i == vm->frameCount - TRACE_FRAMES - 1 && i >= TRACE_FRAMES) {
+            fprintf(vm->err, "... %d more calls\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES;
+            continue;
+        }
+
+        CallFrame* frame = &vm->frames[i];
+        ObjFunction* function = frame->function;
+        // The interpreter advances past each instructin before reading it, so
+        // we need to -1
+        size_t instruction = frame->ip - function->chunk.code - 1;
+        fprintf(vm->err, "[line %d] in ", function->chunk.lines[instruction]);
+        if (function->name == NULL) {
+            fprintf(vm->err, "script\n");
+        } else {
+            fprintf(vm->err, "%s()\n", function->name->chars);
+        }
+    }
+    funlockfile(vm->err);
+
+    closeUpvalues(vm, vm->stack);
+    resetStack(vm);
+}
+
+/*
+ * Grows the value stack so that it has room for at least slots more values,
+ * and fixes up the pointers into it if it moved.
+ */
+static void growStack(VM* vm, int slots) {
+    int count = (int)(vm->stackTop - vm->stack);
+    int oldCapacity = vm->stackCapacity;
+    int capacity = oldCapacity;
+    while (capacity < count + slots) capacity *= 2;
+
+    // The roots are in flux until the pointers are fixed up.
+    vm->gcPaused++;
+    Value* oldStack = vm->stack;
+    vm->stack =
+        GROW_ARRAY(vm, MEM_STACK, Value, vm->stack, oldCapacity, capacity);
+    vm->openUpvalues = GROW_ARRAY(vm, MEM_STACK, ObjUpvalue*, vm->openUpvalues,
+                                  oldCapacity, capacity);
+    for (int i = oldCapacity; i < capacity; i++) vm->openUpvalues[i] = NULL;
+    vm->stackCapacity = capacity;
+    vm->stackTop = vm->stack + count;
+    vm->stackLimit = vm->stack + capacity;
+    vm->gcPaused--;
+    if (vm->stack == oldStack) return;
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = &vm->frames[i];
+        frame->slots = vm->stack + (frame->slots - oldStack);
+    }
+    for (int i = 0; i < count; i++) {
+        if (vm->openUpvalues[i] != NULL) {
+            vm->openUpvalues[i]->location = &vm->stack[i];
+        }
+    }
+}
+
+void reserveStack(VM* vm, int slots) {
+    if (vm->stackLimit - vm->stackTop < slots) growStack(vm, slots);
+}
+
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
+}
+
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(VM* vm, int distance) { return vm->stackTop[-1 - distance]; }
+
+/*
+ * Called once the heap went past its limit, see reallocate(). Returns whether
+ * it is still past it after a full collection, after reporting the error.
+ */
+static bool heapExhausted(VM* vm) {
+    collectNow(vm);
+    vm->outOfMemory = vm->bytesAllocated > vm->heapLimit;
+    if (vm->outOfMemory) {
+        runtimeError(vm, "Out of memory, the heap is limited to %zu bytes.",
+                     vm->heapLimit);
+    }
+    return vm->outOfMemory;
+}
+
+/*
+ * Execution limits, and yielding to the host.
+ *
+ * Steps are counted down a slice at a time, with a single decrement at every
+ * call and loop back edge, and the limits are only looked at once a slice is
+ * used up: the step limit and the quantum exactly, the clock every
+ * STEP_SLICE steps.
+ */
+#define STEP_SLICE 1024
+
+static long long nowUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void nextSlice(VM* vm) {
+    uint64_t slice = STEP_SLICE;
+    if (vm->stepLimit > 0 && vm->stepLimit - vm->steps < slice) {
+        slice = vm->stepLimit - vm->steps + 1;  // Ends on the first step over
+    }
+    if (vm->quantum > 0 && vm->yieldAt - vm->steps < slice) {
+        slice = vm->yieldAt - vm->steps;
+    }
+    vm->steps += slice;
+    vm->sliceLeft = (int)slice;
+}
+
+// Starts the limits over, for something the host runs.
+static void startLimits(VM* vm) {
+    vm->steps = 0;
+    vm->yieldAt = vm->quantum;
+    if (vm->timeLimitUs > 0) vm->deadlineUs = nowUs() + vm->timeLimitUs;
+    nextSlice(vm);
+}
+
+/*
+ * Called when a slice of steps is used up, at a safe point. Returns
+ * INTERPRET_RUNTIME_ERROR if a limit has been reached, after reporting it,
+ * and INTERPRET_YIELD if the quantum has.
+ */
+static InterpretResult endSlice(VM* vm) {
+    if (vm->stepLimit > 0 && vm->steps > vm->stepLimit) {
+        runtimeError(vm, "Ran past the limit of %llu steps.",
+                     (unsigned long long)vm->stepLimit);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    long long now = vm->timeLimitUs > 0 ? nowUs() : 0;
+    if (vm->timeLimitUs > 0 && now >= vm->deadlineUs) {
+        runtimeError(vm, "Ran past the time limit of %ld ms.",
+                     vm->timeLimitUs / 1000);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (vm->quantum > 0 && vm->steps == vm->yieldAt) {
+        // Time spent suspended doesn't count.
+        vm->timeLeftUs = vm->deadlineUs - now;
+        return INTERPRET_YIELD;
+    }
+    nextSlice(vm);
+    return INTERPRET_OK;
+}
+
+/*
+ * Sets up a frame for a call to function. The callee and its arguments are
+ * already in place at the top of the stack, so nothing is copied. This is
+ * where the stack is checked for overflow: once, for the most the function
+ * can ever push.
+ */
+static bool call(VM* vm, ObjFunction* function, Value* upvalues, int argCount) {
+    safePoint(vm);
+    if (vm->outOfMemory && heapExhausted(vm)) return false;
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity,
+                     argCount);
+        return false;
+    }
+
+    if (vm->frameCount == vm->frameCapacity) {
+        if (vm->frameCount == FRAMES_MAX) {
+            runtimeError(vm, "Stack overflow.");
+            return false;
+        }
+
+        // Copied rather than reallocated, so that the sampler never sees the
+        // frames half moved.
+        int oldCapacity = vm->frameCapacity;
+        CallFrame* frames = ALLOCATE(vm, MEM_STACK, CallFrame, oldCapacity * 2);
+        memcpy(frames, vm->frames, sizeof(CallFrame) * oldCapacity);
+        CallFrame* oldFrames = vm->frames;
+        atomic_signal_fence(memory_order_release);
+        vm->frames = frames;
+        vm->frameCapacity = oldCapacity * 2;
+        atomic_signal_fence(memory_order_release);
+        FREE_ARRAY(vm, MEM_STACK, CallFrame, oldFrames, oldCapacity);
+    }
+    reserveStack(vm, function->maxSlots - argCount - 1);
+
+    // The frame is filled in before it is counted, for the same reason.
+    CallFrame* frame = &vm->frames[vm->frameCount];
+    frame->function = function;
+    frame->upvalues = upvalues;
+    frame->ip = function->chunk.code;
+    frame->slots = vm->stackTop - argCount - 1;
+    atomic_signal_fence(memory_order_release);
+    vm->frameCount++;
+    return true;
+}
+
+/*
+ * Calls a native function. Natives don't get a CallFrame: they run right here,
+ * on the arguments where they lie, and leave their result in the callee's slot.
+ */
+static inline bool callNative(VM* vm, ObjNative* native, int argCount) {
+    if (argCount != native->arity && native->arity != NATIVE_VARIADIC) {
+        runtimeError(vm, "Expected %d arguments but got %d.", native->arity,
+                     argCount);
+        return false;
+    }
+
+    Value* args = vm->stackTop - argCount;
+    if (!native->function(vm, argCount, args)) {
+        runtimeError(vm, "%s",
+                     IS_STRING(args[-1]) ? AS_CSTRING(args[-1])
+                                         : "Native function failed.");
+        return false;
+    }
+    vm->stackTop = args;
+    return !vm->outOfMemory || !heapExhausted(vm);
+}
 
-    // The interpreter advances past each instructin before reading it, so we
-    // need to -1
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
-    vm.objects = NULL;  // initialize the global object list
+static bool callValue(VM* vm, Value callee, int argCount) {
+    if (IS_OBJ(callee)) {
+        switch (OBJ_TYPE(callee)) {
+            case OBJ_BOUND_METHOD: {
+                // The receiver takes the place of the callee, as 'this'.
+                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return callValue(vm, bound->method, argCount);
+            }
+            case OBJ_CLASS: {
+                ObjClass* klass = AS_CLASS(callee);
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+                Value initializer;
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
+                    return callValue(vm, initializer, argCount);
+                } else if (argCount != 0) {
+                    runtimeError(vm, "Expected 0 arguments but got %d.",
+                                 argCount);
+                    return false;
+                }
+                return true;
+            }
+            case OBJ_CLOSURE: {
+                ObjClosure* closure = AS_CLOSURE(callee);
+                return call(vm, closure->function, closure->upvalues, argCount);
+            }
+            case OBJ_FUNCTION:
+                return call(vm, AS_FUNCTION(callee), NULL, argCount);
+            case OBJ_NATIVE:
+                return callNative(vm, AS_NATIVE(callee), argCount);
+            default:
+                break;  // Non-callable object type.
+        }
+    }
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+}
+
+/*
+ * Returns the box for a captured local, creating it the first time the local is
+ * captured. Boxes are found by stack slot, so this doesn't have to search.
+ */
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+    ObjUpvalue** upvalue = &vm->openUpvalues[local - vm->stack];
+    if (*upvalue == NULL) *upvalue = newUpvalue(vm, local);
+    return *upvalue;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+/*
+ * Moves the variables in the stack slots from last upwards into their boxes,
+ * before those slots are discarded.
+ */
+static void closeUpvalues(VM* vm, Value* last) {
+    for (Value* slot = vm->stackTop - 1; slot >= last; slot--) {
+        ObjUpvalue** upvalue = &vm->openUpvalues[slot - vm->stack];
+        if (*upvalue == NULL) continue;
+        (*upvalue)->closed = *slot;
+        writeBarrier(vm, (Obj*)*upvalue, *slot);
+        (*upvalue)->location = &(*upvalue)->closed;
+        *upvalue = NULL;
+    }
+}
+
+/*
+ * Replaces the instance on top of the stack with its method called name, bound
+ * to the instance.
+ */
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), method);
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
+    return true;
+}
+
+/*
+ * Adds the method on top of the stack to the class just below it.
+ */
+static void defineMethod(VM* vm, ObjString* name) {
+    Value method = peek(vm, 0);
+    ObjClass* klass = AS_CLASS(peek(vm, 1));
+    tableSet(vm, &klass->methods, name, method);
+    writeBarrier(vm, (Obj*)klass, method);
+    pop(vm);
+}
+
+/*
+ * Inline caches, see chunk.h.
+ */
+static inline InlineCache* siteCache(Chunk* chunk, uint16_t index) {
+    return index == CACHE_UNTRACKED ? NULL : &chunk->caches[index];
+}
+
+// Returns the cached entry for a receiver shape, or NULL on a miss.
+static inline CacheEntry* probeCache(InlineCache* cache, ObjShape* shape) {
+    if (cache == NULL) return NULL;
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            cache->hits++;
+            return &cache->entries[i];
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/*
+ * Records what a site found for a receiver shape, and returns the entry. Once
+ * the cache is full the site is megamorphic, and the result only goes into
+ * scratch.
+ */
+static CacheEntry* fillCache(VM* vm, InlineCache* cache, CacheEntry* scratch,
+                             ObjShape* shape, ObjShape* next, int slot,
+                             Value method) {
+    CacheEntry* entry = scratch;
+    if (cache != NULL && cache->count < CACHE_ENTRIES) {
+        entry = &cache->entries[cache->count++];
+        // The function holding the cache keeps what it saw alive.
+        markBarrier(vm, (Obj*)shape);
+        markBarrier(vm, (Obj*)next);
+        if (IS_OBJ(method)) markBarrier(vm, AS_OBJ(method));
+    }
+    entry->shape = shape;
+    entry->next = next;
+    entry->slot = slot;
+    entry->method = method;
+    return entry;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+/*
+ * The full lookup of a property on a cache miss: the instance's own fields
+ * first, then the methods of its class. Returns NULL if neither has it.
+ */
+static CacheEntry* lookupProperty(VM* vm, InlineCache* cache,
+                                  CacheEntry* scratch, ObjInstance* instance,
+                                  ObjString* name) {
+    int slot = findField(instance->shape, name);
+    if (slot != -1) {
+        return fillCache(vm, cache, scratch, instance->shape, NULL, slot,
+                         NIL_VAL);
+    }
+
+    Value method;
+    if (tableGet(&instance->klass->methods, name, &method)) {
+        return fillCache(vm, cache, scratch, instance->shape, NULL, -1,
+                         method);
+    }
+    return NULL;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+/*
+ * Calls a method of klass on the receiver already in place below the
+ * arguments.
+ */
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name,
+                            int argCount) {
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    return callValue(vm, method, argCount);
+}
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+static void concatenate(VM* vm) {
+    // Left on the stack until the result exists, out of the collector's way.
+    ObjString* b = AS_STRING(peek(vm, 0));
+    ObjString* a = AS_STRING(peek(vm, 1));
+    ObjString* result = concatenateStrings(vm, a, b);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+/*
+ * Arithmetic on number values.
+ *
+ * When both operands are integers the work is done in 64 bits, which can't
+ * overflow for 32 bit operands, and the result stays an integer if it fits.
+ * Anything else is done in double precision, exactly as if the integers had
+ * been doubles all along. The few places where integer and floating point
+ * arithmetic would disagree (negative zero, inexact division) go through
+ * doubles too.
+ */
+static inline Value intResult(int64_t result) {
+    if (result < INT32_MIN || result > INT32_MAX) {
+        return NUMBER_VAL((double)result);  // Promote on overflow.
+    }
+    return INT_VAL((int32_t)result);
+}
+
+static inline Value addNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return intResult((int64_t)AS_INT(a) + AS_INT(b));
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return intResult((int64_t)AS_INT(a) - AS_INT(b));
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t result = (int64_t)AS_INT(a) * AS_INT(b);
+        // 0 * -1 is -0 in floating point.
+        if (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)) {
+            return intResult(result);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        int32_t x = AS_INT(a);
+        int32_t y = AS_INT(b);
+        // Only exact quotients stay integers. 0 / -1 is -0 and INT32_MIN / -1
+        // overflows, so leave those to doubles as well.
+        if (y > 0 || (y < 0 && x != 0 && !(x == INT32_MIN && y == -1))) {
+            if (x % y == 0) return INT_VAL(x / y);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negateNumber(Value a) {
+    if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN) {
+        return INT_VAL(-AS_INT(a));
+    }
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline Value greaterNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+static inline Value lessNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
 }
 
 /*
  * Functions to manage the vm
  */
-void initVM() {
-    resetStack();
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+void initVM(VM* vm) { initSharedVM(vm, NULL); }
+
+/*
+ * Initializes a VM that interns strings in the given shared heap, which must be
+ * frozen already and outlive the VM, before its own table.
+ */
+void initSharedVM(VM* vm, SharedHeap* shared) {
+    // Nothing is reachable until the VM is all set up.
+    vm->bytesAllocated = 0;
+    vm->nextGC = GC_INITIAL_THRESHOLD;
+    initHeapStats(&vm->heapStats);
+    vm->heapLimit = HEAP_UNLIMITED;
+    vm->outOfMemory = false;
+    vm->stepLimit = 0;
+    vm->timeLimitUs = 0;
+    vm->steps = 0;
+    vm->sliceLeft = STEP_SLICE;
+    vm->deadlineUs = 0;
+    vm->quantum = 0;
+    vm->yieldAt = 0;
+    vm->timeLeftUs = 0;
+    vm->keepResult = false;
+    vm->gcPaused = 1;
+    vm->unswept = NULL;
+    vm->parser = NULL;
+    vm->gcPauseUs = 0;
+    vm->marking = NULL;
+    vm->nursery = NULL;
+    vm->nurseryTop = NULL;
+    vm->nurseryLimit = NULL;
+    vm->nurseryEnd = NULL;
+    vm->young = NULL;
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->youngGlobals = false;
+    vm->objects = NULL;
+    vm->shared = shared;
+    vm->out = stdout;
+    vm->err = stderr;
+    initOutput(&vm->output, printToOut, vm);
+    vm->scheduler = NULL;
+    vm->worker = NO_WORKER;
+    vm->task = NULL;
+    atomic_init(&vm->tasksPending, 0);
+    vm->sampler = NULL;
+    vm->frames = ALLOCATE(vm, MEM_STACK, CallFrame, FRAMES_INITIAL);
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->stack = ALLOCATE(vm, MEM_STACK, Value, STACK_INITIAL);
+    vm->stackLimit = vm->stack + STACK_INITIAL;
+    vm->stackCapacity = STACK_INITIAL;
+    vm->openUpvalues = ALLOCATE(vm, MEM_STACK, ObjUpvalue*, STACK_INITIAL);
+    for (int i = 0; i < STACK_INITIAL; i++) vm->openUpvalues[i] = NULL;
+    resetStack(vm);
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    vm->initString = copyString(vm, "init", 4);
+    abortTrace(&vm->trace);
+#ifdef DEBUG_PROFILE_OPCODES
+    initProfile(&vm->profile);
+#endif
+
+    defineNative(vm, "clock", clockNative, 0);
+    defineNative(vm, "spawn", spawnNative, NATIVE_VARIADIC);
+    defineNative(vm, "join", joinNative, 1);
+    vm->gcPaused = 0;
 };
 
-void freeVM() {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
-    freeObjects();
+/*
+ * Makes a C function available to Lox code as a global.
+ *
+ * arity is the number of arguments the function takes, or NATIVE_VARIADIC if
+ * it checks argCount itself.
+ */
+void defineNative(VM* vm, const char* name, NativeFn function, int arity) {
+    // Both objects stay on the stack while the other is being created, so
+    // that they are reachable from the roots.
+    reserveStack(vm, 2);
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function, arity, AS_STRING(peek(vm, 0)))));
+    tableSet(vm, &vm->globals, AS_STRING(peek(vm, 1)), peek(vm, 0));
+    pop(vm);
+    pop(vm);
+}
+
+/*
+ * Copies out what the VM has allocated so far, by kind, see heapstats.h.
+ */
+void getHeapStats(VM* vm, HeapStats* stats) {
+    *stats = vm->heapStats;
+    stats->live = vm->bytesAllocated;
+}
+
+/*
+ * The sink output goes to by default, writing to vm->out.
+ */
+void printToOut(void* vm, const char* chars, size_t length) {
+    writeToFile(((VM*)vm)->out, chars, length);
+}
+
+void freeVM(VM* vm) {
+    freeOutput(&vm->output);
+#ifdef DEBUG_PRINT_CACHES
+    finishSweep(vm);  // Puts what survived back on the list
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)object;
+        printCacheStats(&function->chunk, function->name != NULL
+                                              ? function->name->chars
+                                              : "<script>");
+    }
+#endif
+
+    // They print to this VM's streams, and may still hold on to it.
+    waitForTasks(vm);
+    freeTable(vm, &vm->strings);
+    freeTable(vm, &vm->globals);
+    vm->initString = NULL;
+    freeObjects(vm);
+    freeScheduler(vm);
+#ifdef DEBUG_PROFILE_OPCODES
+    finishProfile(&vm->profile);  // The tasks are all done and freed by now
+#endif
+    FREE_ARRAY(vm, MEM_STACK, ObjUpvalue*, vm->openUpvalues, vm->stackCapacity);
+    FREE_ARRAY(vm, MEM_STACK, Value, vm->stack, vm->stackCapacity);
+    FREE_ARRAY(vm, MEM_STACK, CallFrame, vm->frames, vm->frameCapacity);
 };
 
 /*
  * Runs the virtual machine
  */
-static InterpretResult run() {
+static InterpretResult run(VM* vm) {
+    // The innermost call, the one we are executing.
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+
 // Reads the next byte from the instruction stream and advances the instruction
 // pointer. ip always points to the next instruction to be run
-#define READ_BYTE() (*vm.ip++)
+#define READ_BYTE() (*frame->ip++)
 
 // Reads an index from bytecode and looks up the constant table
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT() \
+    (frame->function->chunk.constants.values[READ_BYTE()])
 
 // Reads a 16-bit operand
-#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << -8) | vm.ip[-1]))
+#define READ_SHORT() \
+    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
 // Reads a String from the constant table.
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-// Carries out a binary operation
-// operators in C are not first class, but here the preprocessor is
-// doing text substitutions so we can use op as such.
-#define BINARY_OP(valueType, op)                          \
-    do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
-        }                                                 \
-        double b = AS_NUMBER(pop());                      \
-        double a = AS_NUMBER(pop());                      \
-        push(valueType(a op b));                          \
+// Reads the index of a site's inline cache and looks the cache up.
+#define READ_CACHE() siteCache(&frame->function->chunk, READ_SHORT())
+
+// Lets the trace recorder see the generic instruction that is running, and the
+// operands it is about to dispatch on.
+#define RECORD()                                                        \
+    do {                                                                \
+        if (vm->trace.recording) {                                      \
+            recordInstruction(&vm->trace, frame->ip - 1, vm->stackTop); \
+        }                                                               \
+    } while (false)
+
+// Carries out a binary operation on two numbers, using one of the arithmetic
+// helpers above as the operator.
+#define BINARY_OP(op)                                             \
+    do {                                                          \
+        RECORD();                                                 \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtimeError(vm, "Operands must be numbers.");        \
+            return INTERPRET_RUNTIME_ERROR;                       \
+        }                                                         \
+        Value b = pop(vm);                                        \
+        Value a = pop(vm);                                        \
+        push(vm, op(a, b));                                       \
+    } while (false)
+
+// Swaps a specialized instruction whose guard failed back to its generic form
+// and steps back so that the generic instruction runs next.
+#define DEOPTIMIZE() (frame->ip[-1] = genericOpCode(frame->ip[-1]), frame->ip--)
+
+// The specialized forms of BINARY_OP, operating on the stack in place. Each
+// checks the one tag its operands must have, and the trace has already seen
+// them there.
+#define INT_OP(op)                                             \
+    do {                                                       \
+        Value b = vm->stackTop[-1];                            \
+        Value a = vm->stackTop[-2];                            \
+        if (!IS_INT(a) || !IS_INT(b)) {                        \
+            DEOPTIMIZE();                                      \
+            break;                                             \
+        }                                                      \
+        vm->stackTop[-2] = op(a, b);                           \
+        vm->stackTop--;                                        \
+    } while (false)
+
+#define DOUBLE_OP(valueType, op)                                      \
+    do {                                                              \
+        Value b = vm->stackTop[-1];                                   \
+        Value a = vm->stackTop[-2];                                   \
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b)) {                         \
+            DEOPTIMIZE();                                             \
+            break;                                                    \
+        }                                                             \
+        vm->stackTop[-2] = valueType(AS_DOUBLE(a) op AS_DOUBLE(b));   \
+        vm->stackTop--;                                               \
+    } while (false)
+
+// Takes a step, first thing in an instruction at a safe point. If the VM
+// stops there to yield, it steps back to run the instruction when it resumes.
+// In between safe points, frame->ip may only be kept in a register, so the
+// fence stores it for the sampler's signal handler to read.
+#define TAKE_STEP()                                      \
+    do {                                                 \
+        atomic_signal_fence(memory_order_release);       \
+        if (--vm->sliceLeft == 0) {                      \
+            InterpretResult stop = endSlice(vm);         \
+            if (stop == INTERPRET_YIELD) frame->ip--;    \
+            if (stop != INTERPRET_OK) return stop;       \
+        }                                                \
     } while (false)
 
     for (;;) {
@@ -116,13 +753,18 @@ static InterpretResult run() {
          * Stack tracing for debugging, print each value in the stack
          */
         printf("        ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
             printf("[ ");
-            printValue(*slot);
+            printValue(stdout, *slot);
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+        disassembleInstruction(
+            &frame->function->chunk,
+            (int)(frame->ip - frame->function->chunk.code));
+#endif
+#ifdef DEBUG_PROFILE_OPCODES
+        profileInstruction(&vm->profile, *frame->ip);
 #endif
 
         /*
@@ -132,48 +774,50 @@ static InterpretResult run() {
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                push(vm, constant);
                 break;
             }
             case OP_NIL:
-                push(NIL_VAL);
+                push(vm, NIL_VAL);
                 break;
             case OP_TRUE:
-                push(BOOL_VAL(true));
+                push(vm, BOOL_VAL(true));
                 break;
             case OP_FALSE:
-                push(BOOL_VAL(false));
+                push(vm, BOOL_VAL(false));
                 break;
             case OP_POP:
-                pop();
+                pop(vm);
                 break;
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]);  // Push the value of a local var to the
-                                       // top of stack
+                push(vm, frame->slots[slot]);  // Push the value of a local var
+                                               // to the top of stack
                 break;
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                vm.stack[slot] =
-                    peek(0);  // leave the value on the top, assignment is also
-                              // an expression that evaluates to a value
+                frame->slots[slot] =
+                    peek(vm, 0);  // leave the value on the top, assignment is
+                                  // also an expression that evaluates to a
+                                  // value
                 break;
             }
             case OP_GET_GLOBAL: {  // Push value of a global variable to stack
                 ObjString* name = READ_STRING();
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if (!tableGet(&vm->globals, name, &value)) {
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                push(vm, value);
                 break;
             }
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+                tableSet(vm, &vm->globals, name, peek(vm, 0));
+                globalsBarrier(vm, peek(vm, 0));
+                pop(vm);
                 /*
                  * Dont't pop the value until after adding to the hash table, so
                  * that the VM can still find the value if a garbage collection
@@ -189,82 +833,384 @@ static InterpretResult run() {
                 ObjString* name = READ_STRING();
                 // If variable hasn't been defined, we cant assign.
                 // No implicit variable declaration in Lox.
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if (tableSet(vm, &vm->globals, name, peek(vm, 0))) {
+                    tableDelete(&vm->globals, name);
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                globalsBarrier(vm, peek(vm, 0));
                 break;
             }
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+                RECORD();
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                push(vm, negateNumber(pop(vm)));
                 break;
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                BINARY_OP(greaterNumbers);
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                BINARY_OP(lessNumbers);
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                RECORD();
+                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    concatenate(vm);
+                    // Concatenation alone can double the heap without a
+                    // loop or a call, to reach a safe point.
+                    if (vm->outOfMemory && heapExhausted(vm)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    Value b = pop(vm);
+                    Value a = pop(vm);
+                    push(vm, addNumbers(a, b));
                 } else {
                     runtimeError(
-                        "Operands must be two numbers or two strings.");
+                        vm, "Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                BINARY_OP(subtractNumbers);
                 break;
             case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+                BINARY_OP(multiplyNumbers);
                 break;
             case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
+                BINARY_OP(divideNumbers);
                 break;
             case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
+                push(vm, BOOL_VAL(isFalsey(pop(vm))));
                 break;
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
+            case OP_PRINT:
+                writeValue(&vm->output, pop(vm));
+                endLine(&vm->output);
                 break;
-            }
             case OP_JUMP: {
                 // Unconditional, always jump
                 uint16_t offset = READ_SHORT();
-                vm.ip += offset;
+                frame->ip += offset;
                 break;
             }
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) vm.ip += offset;
+                if (isFalsey(peek(vm, 0))) frame->ip += offset;
                 break;
             }
             case OP_LOOP: {
+                TAKE_STEP();
                 uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
+                uint8_t loop = READ_BYTE();
+                if (vm->outOfMemory && heapExhausted(vm)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame->ip -= offset;
+                safePoint(vm);
+
+                // Back at the loop header: either we've finished recording an
+                // iteration, or the loop may have just become hot.
+                Chunk* chunk = &frame->function->chunk;
+                if (vm->trace.recording) {
+                    if (loop == vm->trace.loop && chunk == vm->trace.chunk) {
+                        commitTrace(&vm->trace);
+                    }
+                } else if (loop != LOOP_UNTRACKED &&
+                           ++chunk->loopHits[loop] == HOT_LOOP_THRESHOLD) {
+                    startTrace(&vm->trace, chunk, loop);
+                }
+                break;
+            }
+            case OP_CALL: {
+                TAKE_STEP();
+                int argCount = READ_BYTE();
+                Value callee = peek(vm, argCount);
+
+                // Natives run without a frame, so there's none to switch to.
+                if (IS_NATIVE(callee)) {
+                    if (!callNative(vm, AS_NATIVE(callee), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                }
+
+                if (!callValue(vm, callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_CLOSURE: {
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                ObjClosure* closure = newClosure(vm, function);
+                push(vm, OBJ_VAL(closure));
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t flags = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    if (!(flags & UPVALUE_LOCAL)) {
+                        closure->upvalues[i] = frame->upvalues[index];
+                    } else if (flags & UPVALUE_BOXED) {
+                        closure->upvalues[i] =
+                            OBJ_VAL(captureUpvalue(vm, frame->slots + index));
+                    } else {
+                        closure->upvalues[i] = frame->slots[index];
+                    }
+                    writeBarrier(vm, (Obj*)closure, closure->upvalues[i]);
+                }
+                break;
+            }
+            case OP_GET_UPVALUE: {
+                Value value = frame->upvalues[READ_BYTE()];
+                // Captured variables that are never assigned are copied
+                // straight into the closure, the others are boxed.
+                if (IS_UPVALUE(value)) value = *AS_UPVALUE(value)->location;
+                push(vm, value);
+                break;
+            }
+            case OP_SET_UPVALUE: {
+                // Only boxed variables can be assigned.
+                Value box = frame->upvalues[READ_BYTE()];
+                *AS_UPVALUE(box)->location = peek(vm, 0);
+                writeBarrier(vm, AS_OBJ(box), peek(vm, 0));
+                break;
+            }
+            case OP_CLOSE_UPVALUE:
+                closeUpvalues(vm, vm->stackTop - 1);
+                pop(vm);
+                break;
+            case OP_CLASS:
+                push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+                break;
+            case OP_INHERIT: {
+                Value superclass = peek(vm, 1);
+                if (!IS_CLASS(superclass)) {
+                    runtimeError(vm, "Superclass must be a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // Methods are copied down, so lookups never walk the chain.
+                ObjClass* subclass = AS_CLASS(peek(vm, 0));
+                tableAddAll(vm, &AS_CLASS(superclass)->methods,
+                            &subclass->methods);
+                // The superclass keeps the methods alive until it is marked.
+                markBarrier(vm, AS_OBJ(superclass));
+                pop(vm);  // Subclass.
+                break;
+            }
+            case OP_METHOD:
+                defineMethod(vm, READ_STRING());
+                break;
+            case OP_GET_PROPERTY: {
+                if (!IS_INSTANCE(peek(vm, 0))) {
+                    runtimeError(vm, "Only instances have properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+                ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
+
+                CacheEntry scratch;
+                CacheEntry* entry = probeCache(cache, instance->shape);
+                if (entry == NULL) {
+                    entry =
+                        lookupProperty(vm, cache, &scratch, instance, name);
+                    if (entry == NULL) {
+                        runtimeError(vm, "Undefined property '%s'.",
+                                     name->chars);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+
+                // Fields shadow methods.
+                if (entry->slot != -1) {
+                    vm->stackTop[-1] = *instanceField(instance, entry->slot);
+                } else {
+                    ObjBoundMethod* bound =
+                        newBoundMethod(vm, peek(vm, 0), entry->method);
+                    vm->stackTop[-1] = OBJ_VAL(bound);
+                }
+                break;
+            }
+            case OP_SET_PROPERTY: {
+                if (!IS_INSTANCE(peek(vm, 1))) {
+                    runtimeError(vm, "Only instances have fields.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+                ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
+
+                CacheEntry* entry = probeCache(cache, instance->shape);
+                if (entry == NULL) {
+                    // Either an existing field, or the transition that adds it.
+                    CacheEntry scratch;
+                    ObjShape* shape = instance->shape;
+                    int slot = findField(shape, name);
+                    if (slot != -1) {
+                        *instanceField(instance, slot) = peek(vm, 0);
+                        writeBarrier(vm, (Obj*)instance, peek(vm, 0));
+                        fillCache(vm, cache, &scratch, shape, NULL, slot,
+                                  NIL_VAL);
+                    } else {
+                        addField(vm, instance, name, peek(vm, 0));
+                        fillCache(vm, cache, &scratch, shape, instance->shape,
+                                  instance->shape->fieldCount - 1, NIL_VAL);
+                    }
+                } else if (entry->next == NULL) {
+                    *instanceField(instance, entry->slot) = peek(vm, 0);
+                    writeBarrier(vm, (Obj*)instance, peek(vm, 0));
+                } else {
+                    appendField(vm, instance, entry->next, peek(vm, 0));
+                }
+
+                // Leave the value as the result of the assignment.
+                Value value = pop(vm);
+                pop(vm);
+                push(vm, value);
+                break;
+            }
+            case OP_GET_SUPER: {
+                ObjString* name = READ_STRING();
+                ObjClass* superclass = AS_CLASS(pop(vm));
+                if (!bindMethod(vm, superclass, name)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_INVOKE: {
+                TAKE_STEP();
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                InlineCache* cache = READ_CACHE();
+
+                Value receiver = peek(vm, argCount);
+                if (!IS_INSTANCE(receiver)) {
+                    runtimeError(vm, "Only instances have methods.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(receiver);
+                CacheEntry scratch;
+                CacheEntry* entry = probeCache(cache, instance->shape);
+                if (entry == NULL) {
+                    entry =
+                        lookupProperty(vm, cache, &scratch, instance, name);
+                    if (entry == NULL) {
+                        runtimeError(vm, "Undefined property '%s'.",
+                                     name->chars);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+
+                bool called;
+                if (entry->slot != -1) {
+                    // A field holding something callable, which takes the
+                    // receiver's place like any other callee.
+                    Value field = *instanceField(instance, entry->slot);
+                    vm->stackTop[-argCount - 1] = field;
+                    called = callValue(vm, field, argCount);
+                } else {
+                    // The receiver is already where 'this' goes.
+                    called = callValue(vm, entry->method, argCount);
+                }
+                if (!called) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_SUPER_INVOKE: {
+                TAKE_STEP();
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjClass* superclass = AS_CLASS(pop(vm));
+                if (!invokeFromClass(vm, superclass, name, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_RETURN: {
-                return INTERPRET_OK;
+                Value result = pop(vm);
+                if (frame->function->boxesLocals) {
+                    closeUpvalues(vm, frame->slots);
+                }
+                vm->frameCount--;
+
+                // Discard the callee's window of the stack, and leave the
+                // result where the callee used to be.
+                vm->stackTop = frame->slots;
+                push(vm, result);
+                if (vm->frameCount == 0) {
+                    abortTrace(&vm->trace);
+                    return INTERPRET_OK;
+                }
+
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
             }
+            // The integer helpers are inlined, and their checks for doubles
+            // fold away after the ones here.
+            case OP_ADD_INT:
+                INT_OP(addNumbers);
+                break;
+            case OP_SUBTRACT_INT:
+                INT_OP(subtractNumbers);
+                break;
+            case OP_MULTIPLY_INT:
+                INT_OP(multiplyNumbers);
+                break;
+            case OP_DIVIDE_INT:
+                INT_OP(divideNumbers);
+                break;
+            case OP_GREATER_INT:
+                INT_OP(greaterNumbers);
+                break;
+            case OP_LESS_INT:
+                INT_OP(lessNumbers);
+                break;
+            case OP_NEGATE_INT:
+                if (!IS_INT(vm->stackTop[-1])) {
+                    DEOPTIMIZE();
+                    break;
+                }
+                vm->stackTop[-1] = negateNumber(vm->stackTop[-1]);
+                break;
+            case OP_ADD_DOUBLE:
+                DOUBLE_OP(NUMBER_VAL, +);
+                break;
+            case OP_SUBTRACT_DOUBLE:
+                DOUBLE_OP(NUMBER_VAL, -);
+                break;
+            case OP_MULTIPLY_DOUBLE:
+                DOUBLE_OP(NUMBER_VAL, *);
+                break;
+            case OP_DIVIDE_DOUBLE:
+                DOUBLE_OP(NUMBER_VAL, /);
+                break;
+            case OP_GREATER_DOUBLE:
+                DOUBLE_OP(BOOL_VAL, >);
+                break;
+            case OP_LESS_DOUBLE:
+                DOUBLE_OP(BOOL_VAL, <);
+                break;
+            case OP_NEGATE_DOUBLE:
+                if (!IS_DOUBLE(vm->stackTop[-1])) {
+                    DEOPTIMIZE();
+                    break;
+                }
+                vm->stackTop[-1] = NUMBER_VAL(-AS_DOUBLE(vm->stackTop[-1]));
+                break;
         }
     }
 
@@ -272,32 +1218,79 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_CACHE
+#undef RECORD
 #undef BINARY_OP
+#undef DEOPTIMIZE
+#undef INT_OP
+#undef DOUBLE_OP
+#undef TAKE_STEP
 }
 
 /*
  * Interpret the user's source code.
  *
  * This comes in several steps:
- * 1. Create a empty chunk, and fill the chunk with bytecode with compile()
- * 2. Interpret the chunk with the virtual machine
- * 3. Return the result.
+ * 1. Compile the source into a function holding the top level code
+ * 2. Call that function like any other, with no arguments
+ * 3. Run the virtual machine and return the result.
  */
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+// Wraps up a run of the interpreter, which may only have paused.
+static InterpretResult endRun(VM* vm, InterpretResult result) {
+    flushOutput(&vm->output);
+#ifdef DEBUG_PROFILE_OPCODES
+    endProfile(&vm->profile);
+#endif
+    // Only the host calling a function wants its result.
+    if (result == INTERPRET_OK && !vm->keepResult) pop(vm);
+    return result;
+}
 
+InterpretResult interpret(VM* vm, const char* source) {
+    // Constants are old objects, they mustn't be interned young strings.
+    collectNursery(vm);
+    ObjFunction* function = compile(vm, source);
     // Check for a compilation error
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
-    }
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    abortTrace(&vm->trace);  // Don't carry a trace over from an earlier script
+    startLimits(vm);
 
-    InterpretResult result = run();
+    push(vm, OBJ_VAL(function));
+    if (!call(vm, function, NULL, 0)) return INTERPRET_RUNTIME_ERROR;
 
-    freeChunk(&chunk);
-    return result;
+    vm->keepResult = false;
+    return endRun(vm, run(vm));
+}
+
+/*
+ * Calls the callee below the top argCount values on the stack, and runs it
+ * until it returns, or yields. The result is left where the callee was.
+ *
+ * The VM must not be running anything else at the time.
+ */
+InterpretResult callFunction(VM* vm, int argCount) {
+    abortTrace(&vm->trace);
+    startLimits(vm);
+    if (!callValue(vm, vm->stackTop[-argCount - 1], argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    // Natives and classes without an initializer are done already.
+    if (vm->frameCount == 0) return INTERPRET_OK;
+    vm->keepResult = true;
+    return endRun(vm, run(vm));
+}
+
+/*
+ * Carries on with what interpret() or callFunction() returned INTERPRET_YIELD
+ * for, from where it stopped, for another quantum.
+ */
+InterpretResult resumeVM(VM* vm) {
+    abortTrace(&vm->trace);  // Don't hold on to chunks while suspended
+    vm->yieldAt = vm->steps + vm->quantum;
+    if (vm->timeLimitUs > 0) vm->deadlineUs = nowUs() + vm->timeLeftUs;
+    nextSlice(vm);
+    // The step the VM stopped at is taken again, and only counted once.
+    vm->sliceLeft++;
+    return endRun(vm, run(vm));
 }
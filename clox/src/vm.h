@@ -1,35 +1,148 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
-#include "chunk.h"
+#include "heapstats.h"
+#include "object.h"
+#include "output.h"
+#include "profile.h"
+#include "sampler.h"
+#include "shared.h"
 #include "table.h"
+#include "task.h"
+#include "trace.h"
 #include "value.h"
-#define STACK_MAX 256
 
+#define FRAMES_MAX (1 << 16)  // Deepest call nesting before a stack overflow
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// The heapLimit of a VM that may grow its heap as much as it likes.
+#define HEAP_UNLIMITED SIZE_MAX
+
+/*
+ * A single ongoing function call.
+ *
+ * A call doesn't copy its arguments anywhere: the callee and its arguments are
+ * already on the vm's value stack, and slots points at the callee so that the
+ * arguments line up with the function's first locals.
+ */
 typedef struct {
-    Chunk* chunk;
-    uint8_t* ip;  // Instruction pointer, points to the next instruction
-    Value stack[STACK_MAX];
-    Value* stackTop;  // Points to past the last element
+    ObjFunction* function;
+    Value* upvalues;  // Captured variables of the closure being run, if any
+    uint8_t* ip;   // Where to resume in this function's chunk, the caller's
+                   // return address once it calls something
+    Value* slots;  // First stack slot this function can use
+} CallFrame;
+
+/*
+ * The call stack and the value stack both grow on demand.
+ *
+ * Growing the value stack may move it, so nothing holds on to a pointer into
+ * it across a call: frames and open upvalues are fixed up when it moves. The
+ * room a function needs is reserved once when it is called, so pushes never
+ * check for overflow.
+ */
+struct VM {
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+
+    Value* stack;
+    Value* stackTop;    // Points to past the last element
+    Value* stackLimit;  // Points to past the end of the stack
+    int stackCapacity;
+    // The box of each stack slot that a closure has captured by reference, so
+    // that closures capturing the same variable share one box.
+    ObjUpvalue** openUpvalues;
     Table globals;    // Global variables
     Table strings;    // For string interning
+    SharedHeap* shared;  // Interned strings shared with other VMs, or NULL
+    ObjString* initString;  // "init", the name initializers are looked up by
     Obj* objects;     // Points to the list of all objects
-} VM;
+    Trace trace;      // Recorder for the loop currently being traced
+
+    // Where print statements and error messages go, stdout and stderr unless
+    // the embedder redirects them.
+    FILE* out;
+    FILE* err;
+    // What print statements print, on its way to out, see output.h. The host
+    // may set its mode, or give it a sink of its own, which the VM's tasks
+    // call from their threads too, so it must be thread-safe. It is flushed
+    // whenever the VM returns to the host, and before runtime errors and
+    // spawns.
+    Output output;
+
+    Scheduler* scheduler;  // Pool running the tasks, once something spawns one
+    int worker;            // Pool thread running the VM, or NO_WORKER
+    Task* task;               // The task the VM runs, or NULL for the host's
+    atomic_int tasksPending;  // Tasks it spawned that haven't ended yet
+    Sampler* sampler;      // The profiler sampling the VM, if any
+
+    // Limits on how long what the host runs may run, see run(). A step is a
+    // call or a loop iteration.
+    uint64_t stepLimit;    // Most steps it may take, or 0 for no limit
+    long timeLimitUs;      // Longest it may take, or 0 for no limit
+    uint64_t steps;        // Steps taken by the end of the current slice
+    int sliceLeft;         // Steps until the limits are checked again
+    long long deadlineUs;  // When the time limit runs out
+    // Steps to run before yielding to the host, or 0 to run to the end. A VM
+    // that yielded has to be resumed until it is done before it runs
+    // anything else.
+    uint64_t quantum;
+    uint64_t yieldAt;      // Steps taken when the current quantum is up
+    long long timeLeftUs;  // Of the time limit, while suspended
+    bool keepResult;       // Whether the run was a callFunction()
+
+    // Garbage collection, see memory.c.
+    size_t bytesAllocated;
+    size_t nextGC;          // Collect once bytesAllocated grows past this
+    HeapStats heapStats;    // What was allocated, see heapstats.h
+    size_t heapLimit;       // Past this, running code fails, see memory.c
+    bool outOfMemory;       // Whether the heap went past heapLimit
+    int gcPaused;           // Collections wait while this is above zero
+    Obj* unswept;           // Objects the last collection has yet to sweep
+    struct Parser* parser;  // The compilation in progress, if any
+    // Longest a collection step may take, or 0 to mark all at once.
+    long gcPauseUs;
+    struct Marking* marking;  // The incremental collection marking, if any
+
+    // The nursery, where young objects are bump allocated.
+    char* nursery;
+    char* nurseryTop;    // Where the next young object goes
+    char* nurseryLimit;  // Past this, the next safe point collects it
+    char* nurseryEnd;
+    Obj* young;  // Objects in the nursery, newest first
+    // Old objects the write barrier caught pointing into the nursery.
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+    bool youngGlobals;  // Whether a global may hold a young object
+
+#ifdef DEBUG_PROFILE_OPCODES
+    Profile profile;  // Instructions run so far, reported by freeVM()
+#endif
+};
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD  // Stopped at a safe point, to be resumed with resumeVM()
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
+void initVM(VM* vm);
+void initSharedVM(VM* vm, SharedHeap* shared);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult callFunction(VM* vm, int argCount);
+InterpretResult resumeVM(VM* vm);
+void defineNative(VM* vm, const char* name, NativeFn function, int arity);
+void getHeapStats(VM* vm, HeapStats* stats);
+void printToOut(void* vm, const char* chars, size_t length);
 
-// Stack operations
-void push(Value value);
-Value pop();
+// Stack operations, which assume there is room. Code outside of a call has to
+// make sure of it with reserveStack().
+void reserveStack(VM* vm, int slots);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif
\ No newline at end of file
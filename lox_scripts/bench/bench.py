@@ -0,0 +1,405 @@
+"""
+Benchmarks clox on the scripts in this directory.
+
+Every script is run a few times after a warm up run. The report has the
+median and 95th percentile wall time of those runs, the instructions the CPU
+retired (when perf is around to count them) and the peak resident set size.
+It is compared against a baseline saved by an earlier run with --save, which
+records the machine it ran on and the build it ran. The exit status is 1 if a
+script retired more instructions than the threshold allows. Wall time depends
+on the machine and whatever else it is doing, so a slower time is only warned
+about, and only compared with a baseline from the same machine.
+
+A script whose instructions can't be compared, because perf is missing, the
+baseline has no count for it, is from another architecture or there is no
+baseline at all, fails the run too, with the reason, rather than pass
+unchecked. With --gate-on-time such scripts are gated on their median time
+instead, against the wider --time-threshold, on the baseline's machine.
+
+    python3 lox_scripts/bench/bench.py --clox clox/build/release/clox
+
+Needs Python 3.10 or later.
+"""
+
+import argparse
+import json
+import math
+import os
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from dataclasses import asdict, dataclass
+from pathlib import Path
+
+BENCH_DIR = Path(__file__).resolve().parent
+DEFAULT_BASELINE = BENCH_DIR / 'baseline.json'
+
+
+@dataclass
+class Result:
+    median_ms: float
+    p95_ms: float
+    instructions: int | None
+    max_rss_kb: int
+
+
+def compile_stress_source() -> str:
+    """
+    Lots of functions that are compiled but never called, so that running the
+    script is almost all compiling it. They are nested three deep to keep
+    every chunk under the 256 constants it may have.
+    """
+    lines = ['// Generated by bench.py, only ever compiled.']
+    for outer in range(20):
+        lines.append(f'fun outer{outer}() {{')
+        for middle in range(20):
+            lines.append(f'    fun middle{middle}(a, b) {{')
+            for inner in range(50):
+                lines += [
+                    f'        fun inner{inner}(x) {{',
+                    f'            var y = x * {inner} + a - b;',
+                    '            if (y > 10 and !(y == 20)) {',
+                    '                y = y / 2;',
+                    '            } else {',
+                    '                while (y < 100) y = y + 1;',
+                    '            }',
+                    f'            return "v" + "{inner}";',
+                    '        }',
+                ]
+            lines.append('    }')
+        lines.append('}')
+    lines.append('print "compiled";')
+    return '\n'.join(lines) + '\n'
+
+
+def percentile(samples: list[float], fraction: float) -> float:
+    """The nearest-rank percentile."""
+    ordered = sorted(samples)
+    rank = max(1, math.ceil(fraction * len(ordered)))
+    return ordered[rank - 1]
+
+
+def watch_rss(pid: int, peak: list[int], done: threading.Event) -> None:
+    """
+    Keeps reading the high water mark of a process's resident set until it
+    exits. ru_maxrss can't stand in for it: a child forked from this process
+    starts out with all of this process's memory counted as its own.
+    """
+    path = f'/proc/{pid}/status'
+    while not done.is_set():
+        try:
+            with open(path) as status:
+                for line in status:
+                    if line.startswith('VmHWM:'):
+                        peak[0] = max(peak[0], int(line.split()[1]))
+        except (OSError, ValueError):
+            return
+        done.wait(0.001)
+
+
+def run_once(clox: str, script: Path) -> tuple[float, int, bytes]:
+    """Runs the script, and returns its wall time, peak RSS and output."""
+    with tempfile.TemporaryFile() as out, tempfile.TemporaryFile() as err:
+        start = time.perf_counter()
+        process = subprocess.Popen([clox, str(script)], stdout=out, stderr=err)
+        peak = [0]
+        done = threading.Event()
+        watcher = threading.Thread(
+            target=watch_rss, args=(process.pid, peak, done)
+        )
+        watcher.start()
+        process.wait()
+        elapsed = time.perf_counter() - start
+        done.set()
+        watcher.join()
+
+        if process.returncode != 0:
+            err.seek(0)
+            sys.exit(
+                f'{script.name} failed with status {process.returncode}:\n'
+                + err.read().decode(errors='replace')
+            )
+        out.seek(0)
+        return elapsed, peak[0], out.read()
+
+
+def have_perf() -> bool:
+    return shutil.which('perf') is not None
+
+
+def count_instructions(clox: str, script: Path) -> int | None:
+    """Counts the user space instructions of a run with perf, if it can."""
+    if not have_perf():
+        return None
+    with tempfile.NamedTemporaryFile('r') as stats:
+        result = subprocess.run(
+            ['perf', 'stat', '-x', ',', '-e', 'instructions:u',
+             '-o', stats.name, clox, str(script)],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        if result.returncode != 0:
+            return None
+        for line in stats:
+            fields = line.split(',')
+            if len(fields) > 2 and fields[2].startswith('instructions'):
+                return int(fields[0]) if fields[0].isdigit() else None
+    return None
+
+
+def bench(clox: str, script: Path, runs: int, warmup: int) -> Result:
+    times = []
+    rss = 0
+    expected = None
+    for run in range(warmup + runs):
+        elapsed, max_rss, output = run_once(clox, script)
+        if expected is None:
+            expected = output
+        elif output != expected:
+            sys.exit(f'{script.name} printed something else on run {run}.')
+        if run >= warmup:
+            times.append(elapsed * 1000)
+            rss = max(rss, max_rss)
+    return Result(
+        median_ms=round(statistics.median(times), 2),
+        p95_ms=round(percentile(times, 0.95), 2),
+        instructions=count_instructions(clox, script),
+        max_rss_kb=rss,
+    )
+
+
+def change(now: float | None, before: float | None) -> float | None:
+    if now is None or not before:
+        return None
+    return (now - before) / before
+
+
+def describe_host() -> dict[str, str | int | None]:
+    """What the times of a run depend on, besides the build."""
+    cpu = platform.processor() or None
+    try:
+        with open('/proc/cpuinfo') as info:
+            for line in info:
+                if line.startswith('model name'):
+                    cpu = line.split(':', 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    return {
+        'system': platform.system(),
+        'machine': platform.machine(),
+        'cpu': cpu,
+        'cpus': os.cpu_count(),
+    }
+
+
+def first_line(command: list[str]) -> str | None:
+    try:
+        result = subprocess.run(
+            command, capture_output=True, text=True, cwd=BENCH_DIR
+        )
+    except OSError:
+        return None
+    lines = result.stdout.splitlines()
+    return lines[0] if result.returncode == 0 and lines else None
+
+
+def describe_build() -> dict[str, str | None]:
+    """The commit the benchmarked clox was built from, and the compiler."""
+    return {
+        'commit': first_line(['git', 'describe', '--always', '--dirty']),
+        'compiler': first_line(['cc', '--version']),
+    }
+
+
+def uncounted(
+    result: Result, before: dict[str, float], mismatch: str | None
+) -> str | None:
+    """Why a script's instructions can't be compared, if they can't."""
+    if result.instructions is None:
+        if not have_perf():
+            return 'perf is not installed'
+        return 'perf could not count instructions'
+    if mismatch is not None:
+        return mismatch
+    if before.get('instructions') is None:
+        return 'the baseline has no instruction count'
+    return None
+
+
+def report(
+    results: dict[str, Result],
+    baseline: dict[str, dict[str, float]],
+    threshold: float,
+    time_threshold: float | None,
+    same_host: bool,
+    mismatch: str | None,
+) -> list[str]:
+    """
+    Prints the results next to the baseline, and returns what went wrong: the
+    scripts that ran more instructions than the threshold allows, and those
+    whose instructions can't be compared, for the reason in mismatch if it
+    applies to all of them. With a time threshold, the latter are checked on
+    their median time against it instead, which takes a baseline from the
+    same host. Otherwise taking longer only gets a warning.
+    """
+    failures = []
+    print(
+        f'{"script":<12} {"median ms":>10} {"p95 ms":>10} '
+        f'{"instructions":>14} {"rss KB":>8} {"vs baseline":>12}'
+    )
+    for name, result in results.items():
+        before = baseline.get(name)
+        note = ''
+        if before is None:
+            time_change = None
+        else:
+            time_change = (
+                change(result.median_ms, before.get('median_ms'))
+                if same_host else None
+            )
+            reason = uncounted(result, before, mismatch)
+            if reason is None:
+                instruction_change = change(
+                    result.instructions, before.get('instructions')
+                )
+                if instruction_change > threshold:
+                    note = (f'  REGRESSED, {instruction_change:+.1%} '
+                            'instructions')
+                    failures.append(f'{name}: ran {instruction_change:+.1%} '
+                                    'instructions')
+            elif time_threshold is None:
+                note = '  UNCHECKED'
+                failures.append(f"{name}: instructions can't be compared, "
+                                f'{reason}')
+            elif time_change is None:
+                note = '  UNCHECKED'
+                failures.append(f"{name}: instructions can't be compared, "
+                                f'{reason}, and times only on the '
+                                "baseline's machine")
+            elif time_change > time_threshold:
+                note = '  REGRESSED, on time'
+                failures.append(f'{name}: took {time_change:+.1%} as long, '
+                                f"instructions can't be compared, {reason}")
+            if not note and time_change is not None and time_change > threshold:
+                note = '  slower?'
+
+        instructions = (
+            f'{result.instructions:,}' if result.instructions is not None
+            else 'n/a'
+        )
+        versus = (
+            f'{time_change:+.1%}' if time_change is not None
+            else 'n/a' if before is not None else 'new'
+        )
+        print(
+            f'{name:<12} {result.median_ms:>10.1f} {result.p95_ms:>10.1f} '
+            f'{instructions:>14} {result.max_rss_kb:>8} {versus:>12}' + note
+        )
+    return failures
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description='Benchmark clox.')
+    parser.add_argument('--clox', required=True, help='clox binary to run')
+    parser.add_argument('--runs', type=int, default=10)
+    parser.add_argument('--warmup', type=int, default=1)
+    parser.add_argument('--baseline', type=Path, default=DEFAULT_BASELINE)
+    parser.add_argument(
+        '--threshold',
+        type=float,
+        default=0.10,
+        help='growth in instructions that counts as a regression, and in '
+        'time that is warned about, 0.10 being 10%%',
+    )
+    parser.add_argument(
+        '--gate-on-time',
+        action='store_true',
+        help="gate scripts whose instructions can't be compared on their "
+        'time instead of failing them',
+    )
+    parser.add_argument(
+        '--time-threshold',
+        type=float,
+        default=0.50,
+        help='growth in time that counts as a regression with --gate-on-time',
+    )
+    parser.add_argument(
+        '--save', action='store_true', help='make this run the baseline'
+    )
+    args = parser.parse_args()
+
+    results = {}
+    with tempfile.TemporaryDirectory() as scratch:
+        compile_stress = Path(scratch) / 'compile.lox'
+        compile_stress.write_text(compile_stress_source())
+        scripts = sorted(BENCH_DIR.glob('*.lox')) + [compile_stress]
+        for script in scripts:
+            results[script.stem] = bench(
+                args.clox, script, args.runs, args.warmup
+            )
+
+    host = describe_host()
+    build = describe_build()
+    saved = {}
+    if args.baseline.exists():
+        saved = json.loads(args.baseline.read_text())
+    baseline = saved.get('scripts', {})
+    saved_host = saved.get('host') or {}
+    saved_build = saved.get('build') or {}
+
+    same_host = saved_host == host
+    mismatch = None
+    if 'machine' not in saved_host:
+        mismatch = "the baseline doesn't say what machine it is for"
+    elif saved_host['machine'] != host['machine']:
+        mismatch = f"the baseline is for {saved_host['machine']}"
+    if saved:
+        print(f"Baseline: {saved_build.get('commit')} on "
+              f"{saved_host.get('cpu')}, {saved_host.get('cpus')} cpus")
+        if not same_host:
+            print('Times are not compared, the baseline is from another '
+                  'machine.', file=sys.stderr)
+        if saved_build.get('compiler') != build['compiler']:
+            print(f"The baseline was built with {saved_build.get('compiler')},"
+                  ' instruction counts may differ for that alone.',
+                  file=sys.stderr)
+    failures = report(
+        results,
+        baseline,
+        args.threshold,
+        args.time_threshold if args.gate_on_time else None,
+        same_host,
+        mismatch,
+    )
+
+    if args.save:
+        scripts = {name: asdict(result) for name, result in results.items()}
+        args.baseline.write_text(
+            json.dumps(
+                {'host': host, 'build': build, 'scripts': scripts}, indent=2
+            )
+            + '\n'
+        )
+        print(f'Saved the baseline to {args.baseline}.')
+        if any(result.instructions is None for result in results.values()):
+            print(
+                'It has no instruction counts, perf could not count them, so '
+                'bench.py will not pass against it without --gate-on-time.',
+                file=sys.stderr,
+            )
+    elif not saved:
+        sys.exit(f'There is no baseline at {args.baseline}: save one with '
+                 'make bench-baseline where perf can count instructions, and '
+                 'commit it.')
+    elif failures:
+        sys.exit('\n'.join(['Failed:'] + failures))
+
+
+if __name__ == '__main__':
+    main()
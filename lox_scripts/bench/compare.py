@@ -0,0 +1,163 @@
+"""
+Compares the three Lox implementations on the same programs.
+
+Every program is run through clox, jlox and pylox. What an implementation
+prints, and the status it exits with, have to be exactly what clox prints
+and exits with for its time to count: otherwise the table says how it
+failed. Times are the median of a few runs, next to how many times slower
+than clox that is. The first row is the startup latency, the time it takes
+to run an empty program.
+
+    python3 lox_scripts/bench/compare.py --clox clox/build/release/clox
+
+Needs Python 3.10 or later.
+"""
+
+import argparse
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from dataclasses import dataclass
+from pathlib import Path
+
+REPO_DIR = Path(__file__).resolve().parents[2]
+DEFAULT_PROGRAMS = sorted((REPO_DIR / 'lox_scripts').glob('*.lox')) + sorted(
+    (REPO_DIR / 'lox_scripts' / 'bench').glob('*.lox')
+)
+
+
+@dataclass
+class Implementation:
+    name: str
+    command: list[str]  # The program to run goes at the end
+    cwd: Path | None = None
+    missing: str | None = None  # Why it can't be run, if it can't
+
+
+@dataclass
+class Outcome:
+    status: str  # 'ok', or what went wrong
+    median_ms: float = 0.0
+    output: bytes = b''
+    exit_code: int = 0
+
+
+def implementations(clox: str, jlox_jar: Path) -> list[Implementation]:
+    jlox = Implementation('jlox', ['java', '-jar', str(jlox_jar.resolve())])
+    if not jlox_jar.exists():
+        jlox.missing = f'no {jlox_jar}, make jlox'
+    elif shutil.which('java') is None:
+        jlox.missing = 'no java'
+    return [
+        Implementation('clox', [clox]),
+        jlox,
+        Implementation(
+            'pylox',
+            [sys.executable, '-m', 'pylox.main'],
+            cwd=REPO_DIR / 'pylox',
+        ),
+    ]
+
+
+def run(
+    implementation: Implementation, program: Path, runs: int, timeout: float
+) -> Outcome:
+    if implementation.missing is not None:
+        return Outcome('missing')
+
+    times = []
+    output = None
+    exit_code = 0
+    for _ in range(runs):
+        start = time.perf_counter()
+        try:
+            result = subprocess.run(
+                implementation.command + [str(program)],
+                cwd=implementation.cwd,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.DEVNULL,
+                timeout=timeout,
+            )
+        except subprocess.TimeoutExpired:
+            return Outcome('timeout')
+        times.append((time.perf_counter() - start) * 1000)
+        if output is not None and result.stdout != output:
+            return Outcome('unstable')
+        output = result.stdout
+        exit_code = result.returncode
+    return Outcome('ok', statistics.median(times), output or b'', exit_code)
+
+
+def cell(outcome: Outcome, reference: Outcome) -> str:
+    if outcome.status != 'ok':
+        return outcome.status
+    if outcome.exit_code != reference.exit_code:
+        return f'exit {outcome.exit_code}'
+    if outcome.output != reference.output:
+        return 'differs'
+    if outcome is reference or reference.median_ms == 0:
+        return f'{outcome.median_ms:.1f}'
+    ratio = outcome.median_ms / reference.median_ms
+    return f'{outcome.median_ms:.1f} ({ratio:.1f}x)'
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description='Compare clox, jlox and pylox.'
+    )
+    parser.add_argument('--clox', required=True, help='clox binary to run')
+    parser.add_argument(
+        '--jlox-jar', type=Path, default=REPO_DIR / 'build' / 'jlox.jar'
+    )
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument(
+        '--timeout', type=float, default=60, help='seconds a run may take'
+    )
+    parser.add_argument(
+        '--strict',
+        action='store_true',
+        help='fail if an implementation that ran disagreed with clox',
+    )
+    parser.add_argument('programs', nargs='*', type=Path)
+    args = parser.parse_args()
+
+    impls = implementations(args.clox, args.jlox_jar)
+    for impl in impls:
+        if impl.missing is not None:
+            print(f'{impl.name}: {impl.missing}')
+
+    with tempfile.TemporaryDirectory() as scratch:
+        empty = Path(scratch) / 'startup.lox'
+        empty.write_text('')
+        programs = [empty] + [
+            program.resolve() for program in args.programs or DEFAULT_PROGRAMS
+        ]
+
+        widths = [14] + [24] * len(impls)
+        header = ['program'] + [f'{impl.name} ms' for impl in impls]
+        print(' '.join(f'{h:<{w}}' for h, w in zip(header, widths)).rstrip())
+        mismatched = False
+        for program in programs:
+            outcomes = [
+                run(impl, program, args.runs, args.timeout) for impl in impls
+            ]
+            reference = outcomes[0]
+            if reference.status != 'ok':
+                sys.exit(f'clox failed on {program.name}: {reference.status}')
+            cells = [cell(outcome, reference) for outcome in outcomes]
+            mismatched = mismatched or any(
+                outcome.status == 'ok' and not c[0].isdigit()
+                for outcome, c in zip(outcomes, cells)
+            )
+            row = [program.stem] + cells
+            print(' '.join(f'{c:<{w}}' for c, w in zip(row, widths)).rstrip())
+
+    if args.strict and mismatched:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,108 @@
+"""
+Checks clox against the expected output of the scripts in this directory.
+
+Every script is run once, and what it printed to stdout and stderr and its exit
+status are compared with the .expected file next to it, which holds them in
+that order:
+
+    what the script printed
+    [stderr]
+    what it reported, if anything
+    [exit 70]
+
+A first line of the form "// args: --max-steps 1000" passes those arguments to
+clox before the script. Differences are shown as a diff, and the exit status is
+1 if there were any. With --update the .expected files are written from the
+output instead, to be looked over before they are committed.
+
+    python3 lox_scripts/check/check.py --clox clox/build/clox
+
+Needs Python 3.10 or later.
+"""
+
+import argparse
+import difflib
+import subprocess
+import sys
+from pathlib import Path
+
+CHECK_DIR = Path(__file__).resolve().parent
+ARGS_PREFIX = '// args:'
+TIMEOUT_S = 60
+
+
+def script_args(script: Path) -> list[str]:
+    with open(script) as source:
+        first = source.readline()
+    if not first.startswith(ARGS_PREFIX):
+        return []
+    return first[len(ARGS_PREFIX):].split()
+
+
+def run(clox: str, script: Path) -> str:
+    """Runs the script, and returns its output in the .expected format."""
+    try:
+        result = subprocess.run(
+            [clox, *script_args(script), str(script)],
+            capture_output=True,
+            timeout=TIMEOUT_S,
+        )
+    except subprocess.TimeoutExpired:
+        return f'[timed out after {TIMEOUT_S}s]\n'
+
+    output = result.stdout.decode(errors='replace')
+    errors = result.stderr.decode(errors='replace')
+    if errors:
+        output += '[stderr]\n' + errors
+    return output + f'[exit {result.returncode}]\n'
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description='Check clox.')
+    parser.add_argument('--clox', required=True, help='clox binary to run')
+    parser.add_argument(
+        '--update', action='store_true', help='write the .expected files'
+    )
+    parser.add_argument(
+        'scripts',
+        nargs='*',
+        type=Path,
+        help='scripts to check, all of those in this directory by default',
+    )
+    args = parser.parse_args()
+
+    scripts = args.scripts or sorted(CHECK_DIR.glob('*.lox'))
+    failed = []
+    for script in scripts:
+        actual = run(args.clox, script)
+        expected_path = script.with_suffix('.expected')
+        if args.update:
+            expected_path.write_text(actual)
+            print(f'{script.name}: updated')
+            continue
+
+        expected = (
+            expected_path.read_text() if expected_path.exists() else ''
+        )
+        if actual == expected:
+            print(f'{script.name}: ok')
+            continue
+
+        failed.append(script.name)
+        print(f'{script.name}: FAILED')
+        sys.stdout.writelines(
+            difflib.unified_diff(
+                expected.splitlines(keepends=True),
+                actual.splitlines(keepends=True),
+                fromfile=str(expected_path.name),
+                tofile='actual',
+            )
+        )
+
+    if failed:
+        sys.exit(f'{len(failed)} of {len(scripts)} failed: '
+                 + ', '.join(failed))
+
+
+if __name__ == '__main__':
+    main()